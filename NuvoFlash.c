@@ -1,4 +1,5 @@
 //! gcc -Wall -I . -L . "%file%" -o "%name%" -lserialport
+#include <ctype.h>
 #include <getopt.h>
 #include <libserialport.h>
 #include <stdbool.h>
@@ -8,19 +9,106 @@
 #include <string.h>
 #include <sys/stat.h>
 #include <time.h>
+#include "trace.h"
+#ifdef _WIN32
+#include <fcntl.h>
+#include <io.h>
+#include <process.h>
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#endif
 
 #define PAGE_SIZE 128
+#define MAX_FLASH_SIZE (64 * 1024)
+#define MAX_PAGES (MAX_FLASH_SIZE / PAGE_SIZE)
 #define MAX_PATH 260
+#define MAX_PATCHES 64
+#define MAX_PATCH_LEN 16
+#define CONFIG0_LOCK 0x02 // 0 = locked
 
 typedef enum { APROM, LDROM, CONFIG } Mem;
 
-bool quiet = false;
+// Flash geometry and timing of the supported parts, selected by the device id
+// reported by the programmer. LDROM is carved out of the top of the flash,
+// its size is encoded in CONFIG1[2:0] as (7 - LDSIZE) * ldromUnit, up to
+// ldromMax. Times are in us, programming is per byte.
+typedef struct {
+  const char *name;
+  uint16_t devid;
+  int flashSize, pageSize, ldromUnit, ldromMax;
+  int massEraseTime, pageEraseTime, programTime, readTime;
+} Device;
+
+const Device devices[] = {
+    {"N76E003", 0x3650, 18 * 1024, 128, 1024, 4 * 1024, 110000, 11000, 250,
+     30},
+    {"MS51FB9AE", 0x4B21, 16 * 1024, 128, 1024, 4 * 1024, 110000, 11000, 250,
+     30},
+};
+const Device *device;
+int apromSize, ldromSize;
+uint8_t config[5];
+
+bool quiet = false, bench = false;
 struct sp_port *port;
+FILE *capture = NULL;
+uint64_t captureStart;
+const char *journalDir = NULL;
+uint32_t targetUid;
+// how long it takes to get to the first command, reported by --bench
+struct {
+  double discovery, open, first; // s
+  bool cached;
+} startupTime;
+// status byte of the last reply, -1 if there was none
+int lastStatus;
+// errors are expected while soak testing, they are counted instead
+bool muteErrors = false;
+// CONFIG the target is meant to have, if known, see resync()
+const uint8_t *expectedConfig = NULL;
+
+typedef struct {
+  int address, len;
+  uint8_t bytes[MAX_PATCH_LEN];
+} Patch;
+
+Patch patches[MAX_PATCHES];
+int nPatches = 0;
+const char *serialFile = NULL;
+unsigned long serialNumber;
+bool touchedOnly = false, dryRun = false;
+
+// The planner works on the whole flash, APROM pages followed by LDROM ones
+typedef enum { SKIP, ERASE, PROGRAM, ERASE_PROGRAM } PageOp;
+const char *pageOpNames[] = {"skip", "erase", "program", "erase+program"};
+
+uint8_t current[MAX_FLASH_SIZE];
+const uint8_t *target[MAX_PAGES];
+bool targetBlank[MAX_PAGES];
+struct {
+  bool massErase, config;
+  PageOp op[MAX_PAGES];
+  double time; // us
+} plan;
+
+struct {
+  FILE *f;
+  char path[MAX_PATH];
+  bool done[2][MAX_PAGES];
+  uint32_t digest[2][MAX_PAGES];
+} journal;
 
 void usage() {
   fputs("Usage: nuvoflash <options> [file.bin|hex_value]\n", stderr);
   fputs("<mem> must be one of APROM, LDROM, CONFIG\n", stderr);
-  fputs("file.bin must be specified with -r and -w and APROM/LDROM mem types\n",
+  fputs("file.bin must be specified with -r and -w and APROM/LDROM mem types,\n"
+        "use - for stdin/stdout\n",
         stderr);
   fputs("hex_value must be specified with the -w option and CONFIG mem type\n",
         stderr);
@@ -28,6 +116,47 @@ void usage() {
   fputs("  -r/--read <mem>\tread <mem>\n", stderr);
   fputs("  -w/--write <mem>\twrite <mem>\n", stderr);
   fputs("  -x/--massErase\t\tmass erase all flash memory\n", stderr);
+  fputs("  -d/--diff <mem>\tlist the pages of <mem> which differ from "
+        "file.bin\n",
+        stderr);
+  fputs("  -j/--journal <dir>\tkeep a per target write journal in <dir> and "
+        "resume interrupted writes from it\n",
+        stderr);
+  fputs("  -P/--patch <addr>=<hex>\toverlay bytes on the image being written\n",
+        stderr);
+  fputs("  -F/--patch-file <file.csv>\tread overlays from <addr>,<hex> lines\n",
+        stderr);
+  fputs("  -S/--serial <addr>:<len>:<file>\tstore the counter kept in <file> "
+        "at <addr> (LSB first), the counter is incremented before writing and a "
+        "failed write leaves its number unused\n",
+        stderr);
+  fputs("  -T/--touched-only\tthe base image is already on the target, only "
+        "write the pages touched by overlays\n",
+        stderr);
+  fputs("  -n/--dry-run\t\tprint how APROM/LDROM would be written and the "
+        "estimated time, without writing\n",
+        stderr);
+  fputs("  -u/--isp\t\twrite APROM through the ISP bootloader in LDROM "
+        "instead of ICP, not yet tried on hardware\n",
+        stderr);
+  fputs("  -C/--clone <port>\tcopy LDROM, APROM and CONFIG of the target to "
+        "the one on <port>, can be repeated\n",
+        stderr);
+  fputs("  -J/--jobs <file>\trun the jobs listed in <file> on the programmers "
+        "listed there, each job on the first one to become free\n",
+        stderr);
+  fputs("  -k/--soak <count>\trun <count> random reads and writes on the first "
+        "pages of APROM, recovering from failures, and report their cost\n",
+        stderr);
+  fputs("  -b/--bench\t\treport wall time and firmware time per phase\n",
+        stderr);
+  fputs("  -m/--metrics <file>\tadd the counters and latencies of the run to "
+        "<file>, a Prometheus textfile if it ends in .prom, JSON lines "
+        "otherwise\n",
+        stderr);
+  fputs("  -c/--capture <file>\trecord the traffic with the programmer to "
+        "<file>\n",
+        stderr);
   fputs("  -p/--port <port>\tserial port (if omitted it will be automatically "
         "selected)\n",
         stderr);
@@ -48,218 +177,2420 @@ Mem memFromString(const char *s) {
   return -1;
 }
 
-bool selectSerialPort(size_t len, char portName[len]) {
-  struct sp_port **port_list;
-  enum sp_return res = sp_list_ports(&port_list);
+bool isProgrammer(struct sp_port *p) {
+  int vid, pid;
+  return sp_get_port_usb_vid_pid(p, &vid, &pid) == SP_OK && pid == 0xc550 &&
+         vid == 0x1209;
+}
+
+const char *usbSerial(struct sp_port *p) {
+  const char *serial = sp_get_port_usb_serial(p);
+  return serial != NULL ? serial : "";
+}
+
+// The port found by the last search is remembered, together with the USB
+// serial number of the programmer on it, in the user's cache directory
+bool cachePath(char path[MAX_PATH]) {
+#ifdef _WIN32
+  const char *dir = getenv("LOCALAPPDATA"), *sub = "";
+#else
+  const char *dir = getenv("XDG_CACHE_HOME"), *sub = "";
+  if (dir == NULL || *dir == 0) {
+    dir = getenv("HOME");
+    sub = "/.cache";
+  }
+#endif
+  if (dir == NULL || *dir == 0)
+    return false;
+  return snprintf(path, MAX_PATH, "%s%s/nuvoflash-port", dir, sub) < MAX_PATH;
+}
+
+// the cached port is taken if the same programmer is still on it, which
+// only needs a look at that port instead of all of them
+bool cachedSerialPort(size_t len, char portName[len]) {
+  char path[MAX_PATH], line[2 * MAX_PATH], name[MAX_PATH], serial[MAX_PATH];
+  struct sp_port *p;
+  bool found = false;
+  FILE *f;
+
+  if (!cachePath(path) || (f = fopen(path, "r")) == NULL)
+    return false;
+  serial[0] = 0;
+  if (fgets(line, sizeof line, f) != NULL &&
+      sscanf(line, "%259[^\t\n]\t%259[^\n]", name, serial) >= 1 &&
+      sp_get_port_by_name(name, &p) == SP_OK) {
+    found = isProgrammer(p) && strcmp(usbSerial(p), serial) == 0 &&
+            strlen(name) <= len;
+    if (found)
+      strcpy(portName, name);
+    sp_free_port(p);
+  }
+  fclose(f);
+  return found;
+}
+
+void cacheSerialPort(struct sp_port *p) {
+  char path[MAX_PATH];
+  FILE *f;
+
+  if (!cachePath(path) || (f = fopen(path, "w")) == NULL)
+    return;
+  fprintf(f, "%s\t%s\n", sp_get_port_name(p), usbSerial(p));
+  fclose(f);
+}
+
+bool selectSerialPort(size_t len, char portName[len]) {
+  struct sp_port **port_list;
+  bool found = false;
+
+  if (cachedSerialPort(len, portName)) {
+    startupTime.cached = true;
+    return true;
+  }
+  if (sp_list_ports(&port_list) != SP_OK)
+    return false;
+  for (int i = 0; port_list[i] != NULL && !found; i++) {
+    if (!isProgrammer(port_list[i]))
+      continue;
+    strncpy(portName, sp_get_port_name(port_list[i]), len);
+    if (!quiet)
+      fprintf(stderr, "Serial port automatically selected (%s)\n",
+              sp_get_port_description(port_list[i]));
+    cacheSerialPort(port_list[i]);
+    found = true;
+  }
+  sp_free_port_list(port_list);
+  return found;
+}
+
+struct sp_port *openPort(const char *portName) {
+  struct sp_port *p;
+
+  enum sp_return res = sp_get_port_by_name(portName, &p);
+  if (res != SP_OK) {
+    fprintf(stderr, "The serial port %s does not exist, exiting\n", portName);
+    exit(1);
+  }
+  res = sp_open(p, SP_MODE_READ_WRITE);
+  if (res != SP_OK) {
+    fprintf(stderr, "Cannot open serial port %s, exiting\n", portName);
+    exit(1);
+  }
+  res = sp_set_baudrate(p, 115200);
+  if (res != SP_OK) {
+    fputs("Cannot set baud rate, exiting\n", stderr);
+    exit(1);
+  }
+  return p;
+}
+
+uint64_t now() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+// Counters exported with --metrics. Every command adds its latency to the
+// histogram of its kind, the buckets are upper bounds in s.
+typedef enum {
+  OP_READ,
+  OP_STREAM,
+  OP_WRITE,
+  OP_ERASE,
+  OP_PROGRAM,
+  OP_MASS_ERASE,
+  N_OPS
+} Op;
+const char *opNames[] = {"read",  "stream",  "write",
+                         "erase", "program", "mass_erase"};
+#define N_BUCKETS 12
+const double buckets[N_BUCKETS] = {0.0005, 0.001, 0.002, 0.005, 0.01, 0.02,
+                                   0.05,   0.1,   0.2,   0.5,   1,    2};
+struct {
+  uint64_t bytesRead, bytesWritten, count[N_OPS], hist[N_OPS][N_BUCKETS];
+  double sum[N_OPS];
+  int noTarget, verifyFailures;
+} metrics;
+
+void metricOp(Op op, uint64_t start) {
+  double t = (now() - start) / 1e9;
+  int i = 0;
+
+  while (i < N_BUCKETS && t > buckets[i])
+    i++;
+  if (i < N_BUCKETS)
+    metrics.hist[op][i]++;
+  metrics.count[op]++;
+  metrics.sum[op] += t;
+}
+
+void captureOpen(const char *filename) {
+  capture = fopen(filename, "wb");
+  if (capture == NULL) {
+    fprintf(stderr, "Cannot write to file %s\n", filename);
+    exit(1);
+  }
+  fwrite(TRACE_MAGIC, 1, 4, capture);
+  fputc(TRACE_VERSION, capture);
+  captureStart = now();
+}
+
+void captureFrame(uint8_t dir, uint64_t start, size_t requested,
+                  const void *buf, int len) {
+  TraceFrame fr = {start - captureStart, now() - start, dir, 0, requested,
+                   len < 0 ? 0 : len};
+  fwrite(&fr, sizeof fr, 1, capture);
+  fwrite(buf, 1, fr.len, capture);
+}
+
+// all traffic with the programmer goes through these two, so that it can be
+// captured with --capture and analyzed or replayed later by nuvotrace
+int portWrite(const void *buf, size_t len) {
+  uint64_t start = capture != NULL ? now() : 0;
+  int n = sp_blocking_write(port, buf, len, 500);
+  if (capture != NULL)
+    captureFrame(TRACE_WRITE, start, len, buf, n);
+  return n;
+}
+
+int portReadTimeout(void *buf, size_t len, unsigned ms) {
+  uint64_t start = capture != NULL ? now() : 0;
+  int n = sp_blocking_read(port, buf, len, ms);
+  if (capture != NULL)
+    captureFrame(TRACE_READ, start, len, buf, n);
+  return n;
+}
+
+int portRead(void *buf, size_t len) { return portReadTimeout(buf, len, 500); }
+
+// the programmer did not answer in time, or answered less than expected
+bool noResponse() {
+  lastStatus = -1;
+  if (!muteErrors)
+    fprintf(stderr, "Programmer is not responding\n");
+  return false;
+}
+
+bool readStatus() {
+  uint8_t err;
+
+  if (portRead(&err, 1) != 1)
+    return noResponse();
+  lastStatus = err;
+  if (err == 255)
+    metrics.noTarget++;
+  if (err != 0 && !muteErrors) {
+    if (err == 255)
+      fputs("Target board nor responding\n", stderr);
+    else
+      fprintf(stderr, "Programmer returned error code %d\n", err);
+  }
+  return err == 0;
+}
+
+bool readBlock(uint8_t mem, int address, size_t len, uint8_t buf[len]) {
+  uint8_t cmd[5] = {'R', mem, address >> 16, address >> 8, address};
+  uint64_t start = now();
+
+  portWrite(cmd, mem == 'C' ? 2 : sizeof cmd);
+  if (!readStatus())
+    return false;
+  int nBytesRead = portRead(buf, len);
+  if (nBytesRead != len)
+    return noResponse();
+  metricOp(OP_READ, start);
+  metrics.bytesRead += len;
+  return true;
+}
+
+// starts a continuous read of len bytes, which are then received a page at a
+// time with portRead()
+bool streamBlocks(uint8_t mem, int address, int len) {
+  uint8_t cmd[8] = {'S',          mem,      address >> 16, address >> 8,
+                    address,      len >> 16, len >> 8,     len};
+
+  portWrite(cmd, sizeof cmd);
+  return readStatus();
+}
+
+bool writeBlock(uint8_t mem, int address, size_t len, const uint8_t buf[len]) {
+  uint8_t cmd[5] = {'W', mem, address >> 16, address >> 8, address};
+  uint64_t start = now();
+
+  portWrite(cmd, mem == 'C' ? 2 : sizeof cmd);
+  portWrite(buf, len);
+  if (!readStatus())
+    return false;
+  metricOp(OP_WRITE, start);
+  metrics.bytesWritten += len;
+  return true;
+}
+
+bool erasePage(uint8_t mem, int address) {
+  uint8_t cmd[5] = {'E', mem, address >> 16, address >> 8, address};
+  uint64_t start = now();
+
+  portWrite(cmd, sizeof cmd);
+  if (!readStatus())
+    return false;
+  metricOp(OP_ERASE, start);
+  return true;
+}
+
+// programs a page without erasing it first, it must be blank
+bool programPage(uint8_t mem, int address, const uint8_t buf[PAGE_SIZE]) {
+  uint8_t cmd[5] = {'P', mem, address >> 16, address >> 8, address};
+  uint64_t start = now();
+
+  portWrite(cmd, sizeof cmd);
+  portWrite(buf, PAGE_SIZE);
+  if (!readStatus())
+    return false;
+  metricOp(OP_PROGRAM, start);
+  metrics.bytesWritten += PAGE_SIZE;
+  return true;
+}
+
+bool readIdentReply(uint16_t *devid, uint32_t *uid) {
+  uint8_t buf[6];
+
+  if (!readStatus())
+    return false;
+  if (portRead(buf, sizeof buf) != sizeof buf)
+    return noResponse();
+  *devid = buf[0] | buf[1] << 8;
+  *uid = buf[3] | buf[4] << 8 | (uint32_t)buf[5] << 16;
+  return true;
+}
+
+bool readIdent(uint16_t *devid, uint32_t *uid) {
+  portWrite("I", 1);
+  return readIdentReply(devid, uid);
+}
+
+// Pauses before each retry: a glitch costs a few ms, while the last ones
+// outlast the 1 s after which the firmware drops a half received command,
+// until then whatever is sent would be taken as part of it
+#define MAX_RETRIES 6
+const unsigned retryQuietMs[MAX_RETRIES] = {10, 50, 200, 1100, 1100, 1100};
+int failures = 0, retries = 0;
+
+// waits for the programmer to be quiet for ms, throwing away whatever stale
+// bytes are still coming
+void drain(unsigned ms) {
+  uint8_t buf[256];
+
+  while (portReadTimeout(buf, sizeof buf, ms) > 0)
+    ;
+}
+
+// drains the programmer, then checks that it answers again
+bool resync(unsigned ms) {
+  uint8_t buf[256];
+  uint16_t devid;
+  uint32_t uid;
+  bool muted = muteErrors;
+
+  muteErrors = true;
+  drain(ms);
+  bool ok = readIdent(&devid, &uid) && devid == device->devid &&
+            uid == targetUid;
+  // what followed a lost byte may have been run as a mass erase, CONFIG is
+  // put back first: the programmer takes where LDROM pages go from it
+  if (ok && expectedConfig != NULL) {
+    ok = readBlock('C', 0, sizeof config, buf);
+    if (ok && memcmp(buf, expectedConfig, sizeof config) != 0)
+      ok = writeBlock('C', 0, sizeof config, expectedConfig) &&
+           readBlock('C', 0, sizeof config, buf) &&
+           memcmp(buf, expectedConfig, sizeof config) == 0;
+  }
+  muteErrors = muted;
+  return ok;
+}
+
+// Called after a failed operation, returns true once the programmer is back
+// in step and the operation can be tried again, false when *attempt has run
+// out of retries. Every operation keeps its own attempt count, from 0.
+bool retry(int *attempt) {
+  if (*attempt == 0)
+    failures++;
+  while (*attempt < MAX_RETRIES) {
+    retries++;
+    if (resync(retryQuietMs[(*attempt)++]))
+      return true;
+  }
+  fprintf(stderr, "Programmer did not recover after %d retries\n",
+          MAX_RETRIES);
+  return false;
+}
+
+// Reads len bytes streaming STREAM_PAGES at a time, each page is handed to
+// page(). A byte lost in a stream only shows as a short read at its end, so
+// after a failure the whole segment is read again.
+#define STREAM_PAGES 16
+void streamPages(uint8_t mem, int address, int len,
+                 void (*page)(int offset, uint8_t buf[PAGE_SIZE], void *ctx),
+                 void *ctx) {
+  static uint8_t buf[STREAM_PAGES * PAGE_SIZE];
+  int segment = sizeof buf;
+
+  // a failed segment is halved, down to a page, so that a noisy link still
+  // lets one through; each halving gets the whole retry budget, segments
+  // grow back as they succeed
+  for (int i = 0, attempt = 0; i < len;) {
+    int n = len - i < segment ? len - i : segment;
+    uint64_t start = now();
+    if (streamBlocks(mem, address + i, n)) {
+      if (portRead(buf, n) == n) {
+        metricOp(OP_STREAM, start);
+        metrics.bytesRead += n;
+        for (int j = 0; j < n; j += PAGE_SIZE)
+          page(i + j, buf + j, ctx);
+        i += n;
+        attempt = 0;
+        if (segment < sizeof buf)
+          segment *= 2;
+        continue;
+      }
+      noResponse();
+    }
+    if (!retry(&attempt))
+      exit(1);
+    if (n > PAGE_SIZE) {
+      segment = n / 2 / PAGE_SIZE * PAGE_SIZE;
+      attempt = 0;
+    }
+  }
+}
+
+void readPageRetry(uint8_t mem, int address, uint8_t buf[PAGE_SIZE]) {
+  for (int attempt = 0; !readBlock(mem, address, PAGE_SIZE, buf);)
+    if (!retry(&attempt))
+      exit(1);
+}
+
+// A page read back different from what is expected may have been corrupted
+// on the way, it is read again, within the retry budget, before the
+// difference is believed
+bool readPageMatches(uint8_t mem, int address, uint8_t buf[PAGE_SIZE],
+                     const uint8_t expected[PAGE_SIZE]) {
+  readPageRetry(mem, address, buf);
+  for (int attempt = 0; memcmp(buf, expected, PAGE_SIZE) != 0; attempt++) {
+    if (attempt == MAX_RETRIES)
+      return false;
+    if (attempt == 0)
+      failures++;
+    retries++;
+    drain(retryQuietMs[attempt]);
+    readPageRetry(mem, address, buf);
+  }
+  return true;
+}
+
+uint32_t pageDigest(const uint8_t buf[PAGE_SIZE]) {
+  uint32_t h = 2166136261u; // FNV-1a
+
+  for (int i = 0; i < PAGE_SIZE; i++)
+    h = (h ^ buf[i]) * 16777619u;
+  return h;
+}
+
+// The journal records, one line per page, the pages of an image that have
+// been written ('W') and verified ('V') on a given target, so that an
+// interrupted write can be resumed instead of restarted from page 0. 'F'
+// drops the entries of a page which has failed verify. The target is told
+// apart by device id and UID.
+void journalOpen(uint8_t mem) {
+  char line[64], op, m;
+  unsigned addr, digest;
+
+  snprintf(journal.path, sizeof journal.path, "%s/nuvoflash-%04X-%06X.jnl",
+           journalDir, device->devid, targetUid);
+  memset(journal.done, 0, sizeof journal.done);
+  FILE *f = fopen(journal.path, "r");
+  if (f != NULL) {
+    while (fgets(line, sizeof line, f) != NULL)
+      if (sscanf(line, "%c %c %x %x", &op, &m, &addr, &digest) == 4 &&
+          m == mem && addr % PAGE_SIZE == 0 && addr / PAGE_SIZE < MAX_PAGES) {
+        int verify = op == 'V', page = addr / PAGE_SIZE;
+        if (op == 'F')
+          journal.done[0][page] = journal.done[1][page] = false;
+        else if (op == 'W' || op == 'V') {
+          journal.done[verify][page] = true;
+          journal.digest[verify][page] = digest;
+        }
+      }
+    fclose(f);
+  }
+  journal.f = fopen(journal.path, "a");
+  if (journal.f == NULL) {
+    fprintf(stderr, "Cannot write to journal %s\n", journal.path);
+    exit(1);
+  }
+}
+
+// ctx: the first page of the stream, then the count of changed pages
+void checkJournalPage(int offset, uint8_t buf[PAGE_SIZE], void *ctx) {
+  int *check = ctx, page = check[0] + offset / PAGE_SIZE;
+
+  if (pageDigest(buf) != journal.digest[0][page]) {
+    journal.done[0][page] = journal.done[1][page] = false;
+    check[1]++;
+  }
+}
+
+// The pages the journal claims to have written are read back before being
+// skipped, those which have been touched in the meantime are written again
+void journalCheck(uint8_t mem) {
+  int n = 0, check[2] = {0, 0};
+
+  for (int i = 0; i < MAX_PAGES;) {
+    int j = i;
+    while (j < MAX_PAGES && journal.done[0][j])
+      j++;
+    if (j > i) {
+      check[0] = i;
+      streamPages(mem, i * PAGE_SIZE, (j - i) * PAGE_SIZE, checkJournalPage,
+                  check);
+      n += j - i;
+    }
+    i = j + 1;
+  }
+  if (n > 0 && !quiet)
+    fprintf(stderr, "Resuming from journal %s, %d of %d pages changed\n",
+            journal.path, check[1], n);
+}
+
+bool journalDone(int verify, int address, uint32_t digest) {
+  int page = address / PAGE_SIZE;
+  return journal.f != NULL && journal.done[verify][page] &&
+         journal.digest[verify][page] == digest;
+}
+
+void journalAdd(int verify, uint8_t mem, int address, uint32_t digest) {
+  if (journal.f == NULL)
+    return;
+  fprintf(journal.f, "%c %c %04X %08X\n", verify ? 'V' : 'W', mem, address,
+          digest);
+  fflush(journal.f);
+}
+
+// the page is written again by the next run
+void journalFailed(uint8_t mem, int address) {
+  if (journal.f == NULL)
+    return;
+  fprintf(journal.f, "F %c %04X 0\n", mem, address);
+  fflush(journal.f);
+}
+
+// the entries of the other memory are kept for when its write is resumed
+void journalClose(uint8_t mem) {
+  char line[64], tmp[MAX_PATH + 4];
+  bool others = false;
+
+  if (journal.f == NULL)
+    return;
+  fclose(journal.f);
+  journal.f = NULL;
+  snprintf(tmp, sizeof tmp, "%s.tmp", journal.path);
+  FILE *in = fopen(journal.path, "r"), *out = fopen(tmp, "w");
+  if (in != NULL && out != NULL)
+    while (fgets(line, sizeof line, in) != NULL)
+      if (strlen(line) > 2 && line[2] != mem) {
+        fputs(line, out);
+        others = true;
+      }
+  if (in != NULL)
+    fclose(in);
+  if (out != NULL)
+    fclose(out);
+  if (!others) {
+    remove(tmp);
+    remove(journal.path);
+    return;
+  }
+#ifdef _WIN32
+  remove(journal.path);
+#endif
+  if (rename(tmp, journal.path) != 0)
+    fprintf(stderr, "Cannot update journal %s\n", journal.path);
+}
+
+// Exclusive lock on <path>.lock, for the files shared by the runs of a
+// station, which are replaced by renames and so cannot be locked themselves
+#ifdef _WIN32
+typedef HANDLE FileLock;
+#else
+typedef int FileLock;
+#endif
+
+bool lockFile(const char *path, FileLock *lock) {
+  char name[MAX_PATH + 6];
+
+  snprintf(name, sizeof name, "%s.lock", path);
+#ifdef _WIN32
+  OVERLAPPED o = {0};
+  *lock = CreateFileA(name, GENERIC_READ | GENERIC_WRITE,
+                      FILE_SHARE_READ | FILE_SHARE_WRITE, NULL, OPEN_ALWAYS,
+                      0, NULL);
+  if (*lock != INVALID_HANDLE_VALUE &&
+      LockFileEx(*lock, LOCKFILE_EXCLUSIVE_LOCK, 0, 1, 0, &o))
+    return true;
+  if (*lock != INVALID_HANDLE_VALUE)
+    CloseHandle(*lock);
+#else
+  *lock = open(name, O_RDWR | O_CREAT, 0666);
+  if (*lock >= 0 && flock(*lock, LOCK_EX) == 0)
+    return true;
+  if (*lock >= 0)
+    close(*lock);
+#endif
+  fprintf(stderr, "Cannot lock %s\n", name);
+  return false;
+}
+
+void unlockFile(FileLock lock) {
+#ifdef _WIN32
+  CloseHandle(lock);
+#else
+  close(lock);
+#endif
+}
+
+int parseHex(const char *s, uint8_t *buf, int max) {
+  int len = strlen(s);
+
+  if (len == 0 || len % 2 != 0 || len / 2 > max)
+    return -1;
+  for (int i = 0; i < len / 2; i++) {
+    unsigned v;
+    if (!isxdigit(s[2 * i]) || !isxdigit(s[2 * i + 1]) ||
+        sscanf(s + 2 * i, "%2x", &v) != 1)
+      return -1;
+    buf[i] = v;
+  }
+  return len / 2;
+}
+
+Patch *addPatch(int address) {
+  if (nPatches == MAX_PATCHES) {
+    fprintf(stderr, "Too many patches, at most %d are allowed\n", MAX_PATCHES);
+    exit(1);
+  }
+  Patch *p = &patches[nPatches++];
+  p->address = address;
+  return p;
+}
+
+// <addr>=<hex bytes>, separator is '=' on the command line and ',' in files
+bool parsePatch(const char *s, char sep) {
+  char *end;
+  long address = strtol(s, &end, 0);
+  char hex[2 * MAX_PATCH_LEN + 1];
+  uint8_t bytes[MAX_PATCH_LEN];
+  int len;
+
+  if (end == s || *end != sep || address < 0)
+    return false;
+  end += 1 + strspn(end + 1, " \t");
+  size_t n = strspn(end, "0123456789ABCDEFabcdef");
+  if (n >= sizeof hex || end[n + strspn(end + n, " \t\r\n")] != 0)
+    return false;
+  memcpy(hex, end, n);
+  hex[n] = 0;
+  if ((len = parseHex(hex, bytes, MAX_PATCH_LEN)) <= 0)
+    return false;
+  Patch *p = addPatch(address);
+  p->len = len;
+  memcpy(p->bytes, bytes, len);
+  return true;
+}
+
+void readPatchFile(const char *filename) {
+  char line[128];
+  FILE *f = fopen(filename, "r");
+
+  if (f == NULL) {
+    fprintf(stderr, "Cannot read from file %s\n", filename);
+    exit(1);
+  }
+  for (int n = 1; fgets(line, sizeof line, f) != NULL; n++) {
+    if (line[strspn(line, " \t\r\n")] == 0 || line[0] == '#')
+      continue;
+    if (!parsePatch(line, ',')) {
+      fprintf(stderr, "%s:%d: invalid patch, expected <addr>,<hex>\n",
+              filename, n);
+      exit(1);
+    }
+  }
+  fclose(f);
+}
+
+Patch *serialPatch;
+
+void parseSerial(const char *s) {
+  static char file[MAX_PATH];
+  char *end;
+  long address = strtol(s, &end, 0), len;
+
+  if (end == s || *end != ':' || address < 0 ||
+      (len = strtol(end + 1, &end, 0)) < 1 || len > sizeof serialNumber ||
+      *end != ':' || end[1] == 0) {
+    fputs("Invalid serial specification, expected <addr>:<len>:<file>\n",
+          stderr);
+    usage();
+  }
+  strncpy(file, end + 1, sizeof file - 1);
+  serialFile = file;
+  serialPatch = addPatch(address);
+  serialPatch->len = len;
+}
+
+// Takes the next number from the counter and, for a write, stores the one
+// after it straight away, so runs sharing the counter only wait for each
+// other while it is read and replaced. A write that then fails leaves its
+// number unused, the counter never hands out the same one twice. The counter
+// is replaced atomically, a crash never leaves it unreadable.
+void reserveSerial(bool write) {
+  char tmp[MAX_PATH + 4];
+  FileLock lock;
+
+  if (serialFile == NULL)
+    return;
+  if (!lockFile(serialFile, &lock))
+    exit(1);
+  FILE *f = fopen(serialFile, "r");
+  if (f == NULL || fscanf(f, "%lu", &serialNumber) != 1) {
+    fprintf(stderr, "Cannot read counter from file %s\n", serialFile);
+    exit(1);
+  }
+  fclose(f);
+  for (int i = 0; i < serialPatch->len; i++)
+    serialPatch->bytes[i] = serialNumber >> (8 * i);
+  if (write) {
+    snprintf(tmp, sizeof tmp, "%s.tmp", serialFile);
+    f = fopen(tmp, "w");
+    if (f == NULL || fprintf(f, "%lu\n", serialNumber + 1) < 0 || fclose(f)) {
+      fprintf(stderr, "Cannot update counter file %s\n", serialFile);
+      exit(1);
+    }
+#ifdef _WIN32
+    // rename does not replace an existing file there
+    if (!MoveFileExA(tmp, serialFile, MOVEFILE_REPLACE_EXISTING)) {
+#else
+    if (rename(tmp, serialFile) != 0) {
+#endif
+      fprintf(stderr, "Cannot update counter file %s\n", serialFile);
+      exit(1);
+    }
+  }
+  unlockFile(lock);
+}
+
+int patchEnd() {
+  int end = 0;
+
+  for (int i = 0; i < nPatches; i++)
+    if (patches[i].address + patches[i].len > end)
+      end = patches[i].address + patches[i].len;
+  return end;
+}
+
+// overlays the patches falling in the page at address, returns true if any
+bool applyPatches(int address, uint8_t buf[PAGE_SIZE]) {
+  bool touched = false;
+
+  for (int i = 0; i < nPatches; i++)
+    for (int j = 0; j < patches[i].len; j++) {
+      int a = patches[i].address + j;
+      if (a >= address && a < address + PAGE_SIZE) {
+        buf[a - address] = patches[i].bytes[j];
+        touched = true;
+      }
+    }
+  return touched;
+}
+
+void readConfig(uint8_t cfg[]) {
+  for (int attempt = 0; !readBlock('C', 0, 5, cfg);)
+    if (!retry(&attempt))
+      exit(2);
+}
+
+void printConfig(uint8_t cfg[]) {
+  for (int i = 0; i < 5; i++)
+    printf("%02X", cfg[i]);
+  putchar('\n');
+}
+
+void writeConfig(const uint8_t cfg[]) {
+  uint8_t buf[5];
+  expectedConfig = cfg;
+  for (int attempt = 0; !writeBlock('C', 0, 5, cfg);)
+    if (!retry(&attempt))
+      exit(2);
+  readConfig(buf);
+  if (0 != memcmp(cfg, buf, 5)) {
+    metrics.verifyFailures++;
+    fputs("Verify failed\n", stderr);
+    exit(3);
+  }
+}
+
+// "-" stands for stdin/stdout, so that images can be piped in and out
+FILE *openImage(const char *filename, const char *mode) {
+  if (strcmp(filename, "-") != 0)
+    return fopen(filename, mode);
+  FILE *f = mode[0] == 'r' ? stdin : stdout;
+#ifdef _WIN32
+  _setmode(_fileno(f), _O_BINARY);
+#endif
+  return f;
+}
+
+void savePage(int offset, uint8_t buf[PAGE_SIZE], void *ctx) {
+  FILE *f = ctx;
+
+  if (!quiet && f != stdout && isatty(fileno(stdout)))
+    printf("Read: %5d\r", offset);
+  if (fwrite(buf, 1, PAGE_SIZE, f) != PAGE_SIZE) {
+    fputs("Cannot write the image\n", stderr);
+    exit(1);
+  }
+  if (f == stdout)
+    fflush(f);
+}
+
+void readROM(const char *filename, uint8_t mem, int size) {
+  FILE *f = openImage(filename, "wb");
+  if (f == NULL) {
+    fprintf(stderr, "Cannot write to file %s\n", filename);
+    exit(1);
+  }
+  streamPages(mem, 0, size, savePage, f);
+  fclose(f);
+}
+
+void massErase() {
+  expectedConfig = NULL;
+  for (int attempt = 0;;) {
+    uint64_t start = now();
+    portWrite("X", 1);
+    if (readStatus()) {
+      metricOp(OP_MASS_ERASE, start);
+      break;
+    }
+    if (!retry(&attempt))
+      exit(1);
+  }
+}
+
+bool isBlank(const uint8_t *buf, int len) {
+  for (int i = 0; i < len; i++)
+    if (buf[i] != 0xFF)
+      return false;
+  return true;
+}
+
+// An image split in pages, each of which points into the file, mapped in
+// memory, or to a copy of its own when it has been padded or patched or it
+// comes from a pipe. Digests and blank flags are computed once, as pages are
+// added, and shared by everything working on the image.
+typedef struct {
+  uint8_t *map, *copies;
+  size_t mapLen;
+  int nPages, size;
+  bool eof;
+  const uint8_t *page[MAX_PAGES];
+  uint32_t digest[MAX_PAGES];
+  bool blank[MAX_PAGES], touched[MAX_PAGES];
+} Image;
+
+Image image;
+
+// data is NULL for the blank pages following the image which only hold
+// patches, n is the number of valid bytes in data
+void imageAddPage(Image *img, const uint8_t *data, int n) {
+  int i = img->nPages++;
+  uint8_t buf[PAGE_SIZE];
+
+  memset(buf, 0xFF, sizeof buf);
+  if (n > 0)
+    memcpy(buf, data, n);
+  img->touched[i] = applyPatches(i * PAGE_SIZE, buf);
+  if (n == PAGE_SIZE && !img->touched[i] && img->map != NULL)
+    img->page[i] = data;
+  else {
+    if (img->copies == NULL &&
+        (img->copies = malloc(MAX_FLASH_SIZE)) == NULL) {
+      fputs("Out of memory\n", stderr);
+      exit(1);
+    }
+    memcpy(img->copies + i * PAGE_SIZE, buf, PAGE_SIZE);
+    img->page[i] = img->copies + i * PAGE_SIZE;
+  }
+  img->digest[i] = pageDigest(img->page[i]);
+  img->blank[i] = isBlank(img->page[i], PAGE_SIZE);
+}
+
+void imageTooBig(uint8_t mem, int size) {
+  fprintf(stderr, "File is too big, %s size is %d\n",
+          mem == 'A' ? "APROM" : "LDROM", size);
+  exit(1);
+}
+
+// adds the next page from a pipe, checking the size as it goes, returns
+// false at the end of the image
+bool imageRead(Image *img, FILE *f, uint8_t mem) {
+  uint8_t buf[PAGE_SIZE];
+  int n = 0, address = img->nPages * PAGE_SIZE;
+
+  if (address >= img->size)
+    return false;
+  if (!img->eof)
+    n = fread(buf, 1, PAGE_SIZE, f);
+  if (n != PAGE_SIZE)
+    img->eof = true;
+  if (n > 0 && address + n == img->size && !img->eof && fgetc(f) != EOF)
+    imageTooBig(mem, img->size);
+  if (n == 0 && address >= patchEnd())
+    return false;
+  imageAddPage(img, buf, n);
+  return true;
+}
+
+// maps a whole file, pipes are read a page at a time with imageRead()
+void imageLoad(Image *img, FILE *f, uint8_t mem, int size) {
+  struct stat st;
+
+  memset(img, 0, sizeof *img);
+  img->size = size;
+  int err = fstat(fileno(f), &st);
+  // pipes, FIFOs and devices have no size, they are read a page at a time
+  if (err == 0 && !S_ISREG(st.st_mode)) {
+    while (imageRead(img, f, mem))
+      ;
+    return;
+  }
+  if (err != 0 || st.st_size > size)
+    imageTooBig(mem, size);
+  img->mapLen = st.st_size;
+#ifdef _WIN32
+  img->map = malloc(img->mapLen + 1);
+  if (img->map == NULL || fread(img->map, 1, img->mapLen, f) != img->mapLen) {
+#else
+  img->map = img->mapLen == 0 ? NULL
+                              : mmap(NULL, img->mapLen, PROT_READ, MAP_PRIVATE,
+                                     fileno(f), 0);
+  if (img->map == MAP_FAILED) {
+#endif
+    fputs("Cannot read the image\n", stderr);
+    exit(1);
+  }
+  for (int i = 0; i < img->mapLen; i += PAGE_SIZE)
+    imageAddPage(img, img->map + i,
+                 img->mapLen - i < PAGE_SIZE ? img->mapLen - i : PAGE_SIZE);
+  while (img->nPages * PAGE_SIZE < patchEnd())
+    imageAddPage(img, NULL, 0);
+}
+
+void imageFree(Image *img) {
+#ifdef _WIN32
+  free(img->map);
+#else
+  if (img->map != NULL)
+    munmap(img->map, img->mapLen);
+#endif
+  free(img->copies);
+  img->map = img->copies = NULL;
+}
+
+// the cheapest way to turn page cur into tgt, a page is programmed without
+// erasing it only if it is blank
+PageOp pageOp(const uint8_t cur[PAGE_SIZE], const uint8_t tgt[PAGE_SIZE],
+              bool tgtBlank) {
+  if (memcmp(cur, tgt, PAGE_SIZE) == 0)
+    return SKIP;
+  if (tgtBlank)
+    return ERASE;
+  if (isBlank(cur, PAGE_SIZE))
+    return PROGRAM;
+  return ERASE_PROGRAM;
+}
+
+double opTime(PageOp op) {
+  double t = 0;
+  if (op == ERASE || op == ERASE_PROGRAM)
+    t += device->pageEraseTime;
+  if (op == PROGRAM || op == ERASE_PROGRAM)
+    t += PAGE_SIZE * device->programTime;
+  return t;
+}
+
+// config is written with a page erase and 5 bytes of programming
+double configTime() {
+  return device->pageEraseTime + sizeof config * device->programTime;
+}
+
+int memBase(uint8_t mem) { return mem == 'L' ? apromSize : 0; }
+
+// absolute page number to memory type and address inside it
+uint8_t pageMem(int page, int *address) {
+  *address = page * PAGE_SIZE;
+  if (*address < apromSize)
+    return 'A';
+  *address -= apromSize;
+  return 'L';
+}
+
+// reads the current content of the flash, from and len are absolute and
+// must not straddle APROM and LDROM
+void samplePage(int offset, uint8_t buf[PAGE_SIZE], void *ctx) {
+  memcpy((uint8_t *)ctx + offset, buf, PAGE_SIZE);
+}
+
+void sample(int from, int len) {
+  uint8_t mem = from < apromSize ? 'A' : 'L';
+
+  streamPages(mem, from - memBase(mem), len, samplePage, current + from);
+}
+
+void sampleUnknown(int first, int last, const bool known[MAX_PAGES]) {
+  for (int i = first; i < last;) {
+    int j = i;
+    while (j < last && !known[j])
+      j++;
+    if (j > i)
+      sample(i * PAGE_SIZE, (j - i) * PAGE_SIZE);
+    i = j + 1;
+  }
+}
+
+// the pages outside of the image keep their current content
+void targetCurrent(int page) {
+  target[page] = current + page * PAGE_SIZE;
+  targetBlank[page] = isBlank(target[page], PAGE_SIZE);
+}
+
+// Chooses between erasing and programming each page that differs from the
+// image (known[] pages are taken to be on the target already, the others
+// have been sampled into current[]) and a mass erase followed by the
+// programming of every page which is not blank and by the restore of
+// CONFIG, the rest of the flash is sampled only if the mass erase could
+// win given what is known so far
+void makePlan(int first, int last, const bool known[MAX_PAGES]) {
+  int nPages = (apromSize + ldromSize) / PAGE_SIZE;
+  double pageTime = 0, massTime = device->massEraseTime;
+  // a locked target reads as blank, it can only be mass erased and written
+  // again; what lies outside of the image cannot be kept
+  bool locked = !(config[0] & CONFIG0_LOCK);
+
+  memset(&plan, 0, sizeof plan);
+  for (int i = first; i < last; i++) {
+    plan.op[i] = known[i] ? SKIP
+                          : pageOp(current + i * PAGE_SIZE, target[i],
+                                   targetBlank[i]);
+    pageTime += opTime(plan.op[i]);
+    if (!targetBlank[i])
+      massTime += opTime(PROGRAM);
+  }
+  if (!isBlank(config, sizeof config))
+    massTime += configTime();
+  double sampleTime = (nPages - (last - first)) * PAGE_SIZE * device->readTime;
+  if (!locked && (touchedOnly || massTime + sampleTime >= pageTime)) {
+    plan.time = pageTime;
+    return;
+  }
+
+  if (first > 0)
+    sample(0, first * PAGE_SIZE);
+  if (last < nPages)
+    sample(last * PAGE_SIZE, (nPages - last) * PAGE_SIZE);
+  for (int i = 0; i < nPages; i++)
+    if (i < first || i >= last) {
+      targetCurrent(i);
+      if (!targetBlank[i])
+        massTime += opTime(PROGRAM);
+    }
+  if (!locked && massTime >= pageTime) {
+    plan.time = pageTime;
+    return;
+  }
+  plan.massErase = true;
+  plan.config = !isBlank(config, sizeof config);
+  plan.time = massTime;
+  for (int i = 0; i < nPages; i++)
+    plan.op[i] = targetBlank[i] ? SKIP : PROGRAM;
+}
+
+// prints the runs of pages for which op(page) is true
+int printPages(const char *what, bool (*op)(int page)) {
+  int nPages = (apromSize + ldromSize) / PAGE_SIZE, count = 0;
+
+  for (int i = 0; i < nPages;) {
+    int address, a, j = i + 1;
+    uint8_t mem = pageMem(i, &address);
+    bool selected = op(i);
+    while (j < nPages && op(j) == selected && pageMem(j, &a) == mem)
+      j++;
+    if (selected) {
+      fprintf(stderr, "%s 0x%04X-0x%04X: %s (%d pages)\n",
+              mem == 'A' ? "APROM" : "LDROM", address,
+              address + (j - i) * PAGE_SIZE - 1, what, j - i);
+      count += j - i;
+    }
+    i = j;
+  }
+  return count;
+}
+
+PageOp printedOp;
+
+bool isPrintedOp(int page) { return plan.op[page] == printedOp; }
+
+void printPlan() {
+  int nPages = (apromSize + ldromSize) / PAGE_SIZE, changed = 0;
+
+  if (plan.massErase)
+    fputs("mass erase\n", stderr);
+  if (plan.config)
+    fputs("write CONFIG\n", stderr);
+  for (printedOp = ERASE; printedOp <= ERASE_PROGRAM; printedOp++)
+    changed += printPages(pageOpNames[printedOp], isPrintedOp);
+  fprintf(stderr, "%d pages left as they are, estimated time %.2f seconds\n",
+          nPages - changed, plan.time / 1e6);
+}
+
+bool runPageOp(PageOp op, int page) {
+  int address;
+  uint8_t mem = pageMem(page, &address);
+
+  switch (op) {
+  case ERASE:
+    return erasePage(mem, address);
+  case PROGRAM:
+    return programPage(mem, address, target[page]);
+  case ERASE_PROGRAM:
+    return writeBlock(mem, address, PAGE_SIZE, target[page]);
+  default:
+    return true;
+  }
+}
+
+void runPageOpRetry(PageOp op, int page) {
+  for (int attempt = 0; !runPageOp(op, page);) {
+    if (!retry(&attempt))
+      exit(1);
+    // a program cut short leaves the page neither blank nor written
+    if (op == PROGRAM)
+      op = ERASE_PROGRAM;
+  }
+}
+
+// Pages are brought to the image content by the operations chosen by the
+// planner, then those which have been changed are verified. When the image
+// comes from a pipe every page is sampled and written as soon as it has
+// been received, a mass erase is never considered then.
+void writeROM(const char *filename, uint8_t mem, int size) {
+  static bool known[MAX_PAGES];
+  static uint8_t unlocked[5]; // kept as the CONFIG resync puts back
+  uint8_t buf[PAGE_SIZE];
+  int base = memBase(mem), first = base / PAGE_SIZE, last, failed = failures;
+  FILE *f = openImage(filename, "rb");
+  bool stream = f == stdin && !dryRun;
+  if (f == NULL) {
+    fprintf(stderr, "Cannot read from file %s\n", filename);
+    exit(1);
+  }
+  if (journalDir != NULL) {
+    journalOpen(mem);
+    journalCheck(mem);
+  }
+
+  memset(&plan, 0, sizeof plan);
+  if (f == stdin) {
+    memset(&image, 0, sizeof image);
+    image.size = size;
+  } else
+    imageLoad(&image, f, mem, size);
+  for (int i = 0; f == stdin ? imageRead(&image, f, mem) : i < image.nPages;
+       i++) {
+    int page = first + i;
+    target[page] = image.page[i];
+    targetBlank[page] = image.blank[i];
+    known[page] = (touchedOnly && !image.touched[i]) ||
+                  journalDone(0, i * PAGE_SIZE, image.digest[i]);
+    if (known[page])
+      memcpy(current + page * PAGE_SIZE, target[page], PAGE_SIZE);
+    if (!stream || known[page])
+      continue;
+    readPageRetry(mem, i * PAGE_SIZE, current + page * PAGE_SIZE);
+    plan.op[page] = pageOp(current + page * PAGE_SIZE, target[page],
+                           targetBlank[page]);
+    if (!quiet && isatty(fileno(stdout)))
+      printf("Write: %5d\r", i * PAGE_SIZE);
+    runPageOpRetry(plan.op[page], page);
+    journalAdd(0, mem, i * PAGE_SIZE, image.digest[i]);
+  }
+  fclose(f);
+  last = first + image.nPages;
+
+  if (!stream) {
+    sampleUnknown(first, last, known);
+    makePlan(first, last, known);
+    if (dryRun || !quiet)
+      printPlan();
+    if (dryRun) {
+      imageFree(&image);
+      return;
+    }
+    // CONFIG first, the programmer takes the LDROM size and so where LDROM
+    // pages go from the CONFIG it writes; the lock would hide the pages
+    // from verify, it is applied only after it as in clone mode
+    memcpy(unlocked, config, sizeof config);
+    unlocked[0] |= CONFIG0_LOCK;
+    if (plan.massErase)
+      massErase();
+    if (plan.config)
+      writeConfig(unlocked);
+    for (int i = 0; i < (apromSize + ldromSize) / PAGE_SIZE; i++) {
+      if (plan.op[i] == SKIP)
+        continue;
+      if (!quiet && isatty(fileno(stdout)))
+        printf("Write: %5d\r", i * PAGE_SIZE);
+      runPageOpRetry(plan.op[i], i);
+      if (i >= first && i < last)
+        journalAdd(0, mem, (i - first) * PAGE_SIZE, image.digest[i - first]);
+    }
+  }
+
+  // the programmer may have taken what followed a lost byte for a command,
+  // after a failure every page whose content is known is checked, and then
+  // again if rewriting a page has failed in turn
+  bool glitched = failures > failed;
+  for (bool again = true; again;) {
+    again = false;
+    for (int i = 0; i < (apromSize + ldromSize) / PAGE_SIZE; i++) {
+      int address;
+      uint8_t m = pageMem(i, &address);
+      bool inImage = i >= first && i < last;
+      if (glitched ? !inImage && !plan.massErase
+                   : plan.op[i] == SKIP ||
+                         (inImage &&
+                          journalDone(1, address, image.digest[i - first])))
+        continue;
+      if (!quiet && isatty(fileno(stdout)))
+        printf("Verify: %5d\r", i * PAGE_SIZE);
+      bool match = readPageMatches(m, address, buf, target[i]);
+      if (glitched && !match) {
+        metrics.verifyFailures++;
+        failed = failures;
+        runPageOpRetry(ERASE_PROGRAM, i);
+        again |= failures > failed;
+        match = readPageMatches(m, address, buf, target[i]);
+      }
+      if (!match) {
+        metrics.verifyFailures++;
+        fputs("Verify failed\n", stderr);
+        if (inImage)
+          journalFailed(mem, address);
+        exit(3);
+      }
+      if (inImage)
+        journalAdd(1, mem, address, image.digest[i - first]);
+    }
+  }
+  if (plan.config && memcmp(unlocked, config, sizeof config) != 0)
+    writeConfig(config);
+  journalClose(mem);
+  imageFree(&image);
+}
+
+bool isDifferent(int page) { return plan.op[page] != SKIP; }
+
+// compares the image with the target, exits with 3 if they differ
+void diffROM(const char *filename, uint8_t mem, int size) {
+  int first = memBase(mem) / PAGE_SIZE;
+  FILE *f = openImage(filename, "rb");
+  if (f == NULL) {
+    fprintf(stderr, "Cannot read from file %s\n", filename);
+    exit(1);
+  }
+  memset(&plan, 0, sizeof plan);
+  if (f == stdin) {
+    memset(&image, 0, sizeof image);
+    image.size = size;
+    while (imageRead(&image, f, mem))
+      ;
+  } else
+    imageLoad(&image, f, mem, size);
+  fclose(f);
+  if (image.nPages > 0)
+    sample(first * PAGE_SIZE, image.nPages * PAGE_SIZE);
+  for (int i = 0; i < image.nPages; i++)
+    if (memcmp(current + (first + i) * PAGE_SIZE, image.page[i], PAGE_SIZE))
+      plan.op[first + i] = ERASE_PROGRAM;
+  imageFree(&image);
+  if (printPages("differs", isDifferent) > 0)
+    exit(3);
+}
+
+void readAPROM(const char *filename, int size) { readROM(filename, 'A', size); }
+
+void readLDROM(const char *filename, int size) { readROM(filename, 'L', size); }
+
+void writeAPROM(const char *filename, int apromSize) {
+  if (patchEnd() > apromSize) {
+    fprintf(stderr, "Patch out of range, APROM size is %d\n", apromSize);
+    exit(1);
+  }
+  writeROM(filename, 'A', apromSize);
+}
+
+void writeLDROM(const char *filename, int ldromSize) {
+  if (patchEnd() > ldromSize) {
+    fprintf(stderr, "Patch out of range, LDROM size is %d\n", ldromSize);
+    exit(1);
+  }
+  writeROM(filename, 'L', ldromSize);
+}
+
+// ISP over UART: the programmer resets the target so that the bootloader in
+// its LDROM starts, then bridges Nuvoton ISP packets to it. APROM is updated
+// without entering ICP mode and verified by the checksum the bootloader
+// computes over what it has programmed.
+// The packet layout follows the NuMicro ISP protocol of Nuvoton's ISP tool:
+// a reply carries the 16 bit sum of the packet received in bytes 0-1 and the
+// packet number plus one in bytes 4-7, commands number their packets 1, 3,
+// 5... Taking bytes 8-9 of the UPDATE_APROM and CONTINUE replies for the sum
+// of what has been programmed so far, and READ_CHECKSUM for the sum over an
+// address range, is this tool's reading of the bootloader, not checked
+// against a real one: nuvosim models the same reading, so it cannot catch a
+// mistake in it, and this path has not been run on hardware.
+#define ISP_PACKET 64
+#define ISP_FIRST_DATA 48 // data bytes in the UPDATE_APROM packet
+#define ISP_DATA 56       // and in each of the CONTINUE packets after it
+#define ISP_BATCH 32      // packets per U command
+#define ISP_TRIES 3
+#define ISP_TIMEOUT 100 // ms for the target to answer a packet
+
+#define ISP_CONTINUE 0x00
+#define ISP_UPDATE_APROM 0xA0
+#define ISP_READ_CONFIG 0xA2
+#define ISP_RUN_APROM 0xAB
+#define ISP_CONNECT 0xAE
+#define ISP_GET_DEVICEID 0xB1
+#define ISP_READ_CHECKSUM 0xC8
+
+bool isp = false;
+uint32_t ispPackNo;
+uint8_t ispPackets[ISP_BATCH][ISP_PACKET];
+int nIspPackets = 0;
+
+uint32_t get32(const uint8_t *p) {
+  return p[0] | p[1] << 8 | p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+void put32(uint8_t *p, uint32_t v) {
+  for (int i = 0; i < 4; i++)
+    p[i] = v >> 8 * i;
+}
+
+uint16_t ispSum(const uint8_t *buf, int len) {
+  uint16_t sum = 0;
+
+  for (int i = 0; i < len; i++)
+    sum += buf[i];
+  return sum;
+}
+
+// queues a packet for ispSend(), which numbers it
+uint8_t *ispPacket(uint8_t cmd) {
+  uint8_t *p = ispPackets[nIspPackets++];
+
+  memset(p, 0, ISP_PACKET);
+  p[0] = cmd;
+  return p;
+}
+
+// Sends the queued packets with a single U command. The programmer hands
+// them to the target one at a time, an answer is checked against the sum and
+// number of its packet. All the replies are read even after a failure, to
+// stay in step with the programmer. Returns how many packets, from the
+// first, were answered correctly.
+int ispSend(unsigned timeout, uint8_t replies[][ISP_PACKET]) {
+  static uint8_t cmd[4 + ISP_BATCH * ISP_PACKET];
+  uint8_t status, reply[ISP_PACKET];
+  int n = nIspPackets, good = n, i;
+  bool silent = false, bad = false;
+
+  cmd[0] = 'U';
+  cmd[1] = n;
+  cmd[2] = ~n;
+  cmd[3] = timeout < 2550 ? (timeout + 9) / 10 : 255;
+  for (i = 0; i < n; i++) {
+    put32(ispPackets[i] + 4, ispPackNo + 2 * i);
+    memcpy(cmd + 4 + i * ISP_PACKET, ispPackets[i], ISP_PACKET);
+  }
+  nIspPackets = 0;
+  ispPackNo += 2 * n;
+  portWrite(cmd, 4 + n * ISP_PACKET);
+  for (i = 0; i < n; i++) {
+    if (portReadTimeout(&status, 1, timeout + 500) != 1)
+      break;
+    lastStatus = status;
+    if (status != 0) {
+      silent = true;
+      good = i < good ? i : good;
+      continue;
+    }
+    if (portRead(reply, sizeof reply) != sizeof reply)
+      break;
+    uint8_t *sent = cmd + 4 + i * ISP_PACKET;
+    uint16_t sum = ispSum(sent, ISP_PACKET);
+    if (reply[0] != (sum & 0xFF) || reply[1] != sum >> 8 ||
+        get32(reply + 4) != get32(sent + 4) + 1) {
+      bad = true;
+      good = i < good ? i : good;
+    }
+    if (replies != NULL)
+      memcpy(replies[i], reply, ISP_PACKET);
+  }
+  if (i < n) {
+    noResponse();
+    good = i < good ? i : good;
+  } else if (silent && !muteErrors)
+    fputs("ISP bootloader not responding\n", stderr);
+  else if (bad && !muteErrors)
+    fputs("Bad reply from the ISP bootloader\n", stderr);
+  return good;
+}
+
+// Resets the target into the bootloader, which only listens for a while
+// after reset, connects and reads the device id and CONFIG. The pauses
+// between attempts are those of retry(), to outlast a half received command.
+bool ispConnect(uint16_t *devid) {
+  uint8_t replies[3][ISP_PACKET];
+  bool ok = false, muted = muteErrors;
+
+  muteErrors = true;
+  for (int attempt = 0; attempt <= MAX_RETRIES && !ok; attempt++) {
+    if (attempt > 0)
+      drain(retryQuietMs[attempt - 1]);
+    portWrite("B", 1);
+    if (!readStatus())
+      continue;
+    ispPackNo = 1;
+    ispPacket(ISP_CONNECT);
+    ispPacket(ISP_GET_DEVICEID);
+    ispPacket(ISP_READ_CONFIG);
+    ok = ispSend(ISP_TIMEOUT, replies) == 3;
+  }
+  muteErrors = muted;
+  if (!ok) {
+    fputs("No ISP bootloader answering, CONFIG0.CBS must select LDROM "
+          "boot\n",
+          stderr);
+    return false;
+  }
+  *devid = get32(replies[1] + 8);
+  memcpy(config, replies[2] + 8, sizeof config);
+  return true;
+}
+
+// One UPDATE_APROM run from address from to the end of the image, the
+// bootloader erases the pages it covers on the first packet. Every reply
+// carries the checksum of what has been programmed in the run so far, *done
+// is moved past the packets whose checksum matched.
+bool ispUpdate(int from, int len, int *done) {
+  static uint8_t replies[ISP_BATCH][ISP_PACKET];
+  int ends[ISP_BATCH];
+  uint16_t sums[ISP_BATCH], sum = 0;
+  unsigned timeout = ISP_TIMEOUT + (len - from + PAGE_SIZE - 1) / PAGE_SIZE *
+                                       device->pageEraseTime / 1000;
 
-  if (res != SP_OK)
-    return false;
-  for (int i = 0; port_list[i] != NULL; i++) {
-    int vid, pid;
-    res = sp_get_port_usb_vid_pid(port_list[i], &vid, &pid);
-    if (res != SP_OK)
+  for (int offset = from; offset < len;) {
+    int i = nIspPackets, at = 8;
+    uint8_t *p = ispPacket(offset == from ? ISP_UPDATE_APROM : ISP_CONTINUE);
+    if (offset == from) {
+      put32(p + 8, from);
+      put32(p + 12, len - from);
+      at = 16;
+    }
+    for (; at < ISP_PACKET && offset < len; at++, offset++)
+      sum += p[at] = image.page[offset / PAGE_SIZE][offset % PAGE_SIZE];
+    ends[i] = offset;
+    sums[i] = sum;
+    if (nIspPackets < ISP_BATCH && offset < len)
       continue;
-    if (pid == 0xc550 && vid == 0x1209) {
-      strncpy(portName, sp_get_port_name(port_list[i]), len);
-      if (!quiet)
-        fprintf(stderr, "Serial port automatically selected (%s)\n",
-                sp_get_port_description(port_list[i]));
-      return true;
+    int n = nIspPackets, good = ispSend(timeout, replies);
+    timeout = ISP_TIMEOUT;
+    for (int j = 0; j < good; j++) {
+      if ((replies[j][8] | replies[j][9] << 8) != sums[j]) {
+        metrics.verifyFailures++;
+        if (!muteErrors)
+          fprintf(stderr, "Checksum mismatch before 0x%04X\n", ends[j]);
+        return false;
+      }
+      *done = ends[j];
     }
+    if (good < n)
+      return false;
+    if (!quiet && isatty(fileno(stdout)))
+      printf("Write: %5d\r", offset);
   }
-  sp_free_port_list(port_list);
-  return false;
+  return true;
 }
 
-bool readBlock(uint8_t mem, int address, size_t len, uint8_t buf[len]) {
-  uint8_t err, cmd[4] = {'R', mem, address >> 8, address};
+// The checksum of the whole image is asked for at the end, as pages
+// checked earlier may have been hit by what the programmer made of a
+// garbled command. On a mismatch the image is written again.
+bool ispVerify(int len, uint16_t sum, int *done) {
+  uint8_t reply[1][ISP_PACKET];
+  uint8_t *p = ispPacket(ISP_READ_CHECKSUM);
 
-  sp_blocking_write(port, cmd, mem == 'C' ? 2 : 4, 500);
-  int nBytesRead = sp_blocking_read(port, &err, 1, 500);
-  if (nBytesRead != 1) {
-    fprintf(stderr, "Programmer is not responding\n");
+  put32(p + 8, 0);
+  put32(p + 12, len);
+  if (ispSend(ISP_TIMEOUT, reply) != 1)
     return false;
+  if ((reply[0][8] | reply[0][9] << 8) == sum)
+    return true;
+  metrics.verifyFailures++;
+  if (!muteErrors)
+    fputs("APROM checksum mismatch\n", stderr);
+  *done = 0;
+  return false;
+}
+
+// A failed run is taken up again from reset, at the page where checked
+// data ends, giving up after ISP_TRIES runs in a row that get no further
+void ispWriteAPROM(const char *filename) {
+  FILE *f = openImage(filename, "rb");
+  uint16_t devid, sum = 0;
+  int len, done = 0;
+
+  if (f == NULL) {
+    fprintf(stderr, "Cannot read from file %s\n", filename);
+    exit(1);
   }
-  if (err != 0) {
-    if (err == 255)
-      fputs("Target board nor responding\n", stderr);
-    else
-      fprintf(stderr, "Programmer returned error code %d\n", err);
-    return false;
+  if (patchEnd() > apromSize) {
+    fprintf(stderr, "Patch out of range, APROM size is %d\n", apromSize);
+    exit(1);
+  }
+  if (f == stdin) {
+    memset(&image, 0, sizeof image);
+    image.size = apromSize;
+    while (imageRead(&image, f, 'A'))
+      ;
+  } else
+    imageLoad(&image, f, 'A', apromSize);
+  fclose(f);
+  len = image.nPages * PAGE_SIZE;
+  for (int i = 0; i < image.nPages; i++)
+    sum += ispSum(image.page[i], PAGE_SIZE);
+
+  for (int attempt = 0; len > 0;) {
+    int before = done;
+    if (ispUpdate(done / PAGE_SIZE * PAGE_SIZE, len, &done) &&
+        ispVerify(len, sum, &done))
+      break;
+    failures++;
+    attempt = done > before ? 0 : attempt + 1;
+    if (attempt == ISP_TRIES) {
+      fputs("ISP update failed\n", stderr);
+      exit(1);
+    }
+    retries++;
+    if (!ispConnect(&devid))
+      exit(2);
   }
-  nBytesRead = sp_blocking_read(port, buf, len, 500);
-  if (nBytesRead != len) {
+  metrics.bytesWritten += len;
+  imageFree(&image);
+
+  // the bootloader does not answer this one, it resets into APROM
+  bool muted = muteErrors;
+  muteErrors = true;
+  ispPacket(ISP_RUN_APROM);
+  ispSend(10, NULL);
+  muteErrors = muted;
+}
+
+const Device *findDevice(uint16_t devid) {
+  for (int i = 0; i < sizeof devices / sizeof *devices; i++)
+    if (devices[i].devid == devid)
+      return &devices[i];
+  return NULL;
+}
+
+// firmware time per phase, see PH_* in NuvoFlash.ino
+const char *phaseNames[] = {"idle",      "USB receive", "ICP send",
+                            "ICP erase", "ICP read/write", "USB send"};
+#define N_PHASES (sizeof phaseNames / sizeof *phaseNames)
+
+// fetches and resets the firmware counters, ticks are converted to seconds
+bool readPhasesReply(double phases[N_PHASES]) {
+  uint8_t buf[4 * (N_PHASES + 1)];
+
+  if (!readStatus())
+    return false;
+  if (portRead(buf, sizeof buf) != sizeof buf) {
     fprintf(stderr, "Programmer is not responding\n");
     return false;
   }
+  uint32_t v[N_PHASES + 1];
+  for (int i = 0; i <= N_PHASES; i++)
+    v[i] = buf[4 * i] | buf[4 * i + 1] << 8 | buf[4 * i + 2] << 16 |
+           (uint32_t)buf[4 * i + 3] << 24;
+  for (int i = 0; i < N_PHASES; i++)
+    phases[i] = (double)v[i + 1] / v[0];
   return true;
 }
 
-bool writeBlock(uint8_t mem, int address, size_t len, const uint8_t buf[len]) {
-  uint8_t err, cmd[4] = {'W', mem, address >> 8, address};
+bool readPhases(double phases[N_PHASES]) {
+  portWrite("T", 1);
+  return readPhasesReply(phases);
+}
 
-  sp_blocking_write(port, cmd, mem == 'C' ? 2 : 4, 500);
-  sp_blocking_write(port, buf, len, 500);
-  int nBytesRead = sp_blocking_read(port, &err, 1, 500);
-  if (nBytesRead != 1) {
-    fprintf(stderr, "Programmer is not responding\n");
-    return false;
+// The first commands (counters reset, ident and CONFIG) are sent together
+// and their replies read afterwards, instead of a round trip each. A failed
+// CONFIG read is retried once the device, needed to resync, is known.
+// A run cut short may have left its replies on the line, or the programmer
+// inside a command which takes the burst for its data: without a good
+// ident the line is drained for longer than the programmer waits for data
+// and the ident is asked for once more on its own.
+bool firstCommands(uint16_t *devid, double phases[N_PHASES], bool *gotConfig) {
+  const uint8_t cmds[] = {'T', 'I', 'R', 'C'};
+  int skip = bench ? 0 : 1;
+
+  sp_flush(port, SP_BUF_INPUT);
+  portWrite(cmds + skip, sizeof cmds - skip);
+  muteErrors = true;
+  bool ok = (!bench || readPhasesReply(phases)) &&
+            readIdentReply(devid, &targetUid) && findDevice(*devid) != NULL;
+  muteErrors = false;
+  if (ok) {
+    *gotConfig =
+        readStatus() && portRead(config, sizeof config) == sizeof config;
+    return true;
   }
-  if (err != 0) {
-    if (err == 255)
-      fputs("Target board nor responding\n", stderr);
-    else
-      fprintf(stderr, "Programmer returned error code %d\n", err);
-    return false;
+  failures++;
+  retries++;
+  drain(retryQuietMs[MAX_RETRIES - 1]);
+  *gotConfig = false;
+  return (!bench || readPhases(phases)) && readIdent(devid, &targetUid);
+}
+
+void printBench(double wall, const double phases[N_PHASES]) {
+  double total = 0;
+
+  for (int i = 0; i < N_PHASES; i++)
+    total += phases[i];
+  fprintf(stderr, "Host wall time %25.3f s\n", wall);
+  fprintf(stderr, "  %-16s %20.3f s%s\n", "port discovery",
+          startupTime.discovery,
+          startupTime.cached ? " (cached)" : "");
+  fprintf(stderr, "  %-16s %20.3f s\n", "port open", startupTime.open);
+  fprintf(stderr, "  %-16s %20.3f s\n", "first commands",
+          startupTime.first);
+  fprintf(stderr, "Firmware time %26.3f s\n", total);
+  for (int i = 0; i < N_PHASES; i++)
+    fprintf(stderr, "  %-16s %20.3f s %5.1f%%\n", phaseNames[i], phases[i],
+            total > 0 ? 100 * phases[i] / total : 0);
+}
+
+// Soak testing: random page reads, streamed reads and page writes on the
+// first SOAK_PAGES pages of APROM, with the programmer brought back in step
+// after each failure and the time this takes measured
+#define SOAK_PAGES 8
+
+typedef enum { TIMEOUT, NO_TARGET, ERROR_CODE, MISMATCH, N_FAILURES } Failure;
+const char *failureNames[] = {"timeout", "target not responding",
+                              "error code", "data mismatch"};
+
+int cmpU64(const void *a, const void *b) {
+  uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+  return x < y ? -1 : x > y;
+}
+
+void printLatencies(const char *what, uint64_t *ns, int n) {
+  if (n == 0)
+    return;
+  qsort(ns, n, sizeof *ns, cmpU64);
+  fprintf(stderr, "%-10s p50 %8.1f ms  p95 %8.1f ms  p99 %8.1f ms  max %8.1f ms\n",
+          what, ns[n / 2] / 1e6, ns[(n - 1) * 95 / 100] / 1e6,
+          ns[(n - 1) * 99 / 100] / 1e6, ns[n - 1] / 1e6);
+}
+
+void soak(int count) {
+  static uint8_t shadow[SOAK_PAGES * PAGE_SIZE], buf[SOAK_PAGES * PAGE_SIZE];
+  bool valid[SOAK_PAGES] = {false};
+  uint64_t *detect = malloc(count * sizeof(uint64_t));
+  uint64_t *recover = malloc(count * sizeof(uint64_t));
+  uint64_t okTime = 0, begin = now();
+  long okBytes = 0;
+  int byKind[N_FAILURES] = {0}, nFailed = 0, done;
+
+  muteErrors = true;
+  srand(time(NULL));
+  for (done = 0; done < count; done++) {
+    int page = rand() % SOAK_PAGES, kind = rand() % 10, bytes = PAGE_SIZE;
+    uint8_t *expected = shadow + page * PAGE_SIZE;
+    uint64_t start = now();
+    bool ok;
+
+    // a page whose write failed is in an unknown state until rewritten
+    if (!valid[page] || kind < 4) {
+      for (int i = 0; i < PAGE_SIZE; i++)
+        expected[i] = rand();
+      valid[page] = false;
+      ok = writeBlock('A', page * PAGE_SIZE, PAGE_SIZE, expected) &&
+           readBlock('A', page * PAGE_SIZE, PAGE_SIZE, buf);
+      valid[page] = ok;
+    } else if (kind < 8)
+      ok = readBlock('A', page * PAGE_SIZE, PAGE_SIZE, buf);
+    else {
+      page = 0;
+      expected = shadow;
+      bytes = sizeof buf;
+      ok = streamBlocks('A', 0, bytes) && portRead(buf, bytes) == bytes;
+      if (!ok && lastStatus == 0)
+        lastStatus = -1; // the stream was cut short
+      for (int i = 0; ok && i < SOAK_PAGES; i++)
+        if (!valid[i])
+          memcpy(buf + i * PAGE_SIZE, shadow + i * PAGE_SIZE, PAGE_SIZE);
+    }
+    if (ok && memcmp(buf, expected, bytes) != 0) {
+      byKind[MISMATCH]++;
+      ok = false;
+      valid[page] = false;
+    } else if (!ok)
+      byKind[lastStatus < 0     ? TIMEOUT
+               : lastStatus == 255 ? NO_TARGET
+                                   : ERROR_CODE]++;
+    uint64_t failed = now();
+    if (ok) {
+      okTime += failed - start;
+      okBytes += bytes;
+    } else {
+      int attempt = 0;
+      if (!retry(&attempt))
+        break;
+      detect[nFailed] = failed - start;
+      recover[nFailed++] = now() - failed;
+    }
+    if (!quiet && isatty(fileno(stdout)))
+      printf("Soak: %6d/%d, %d failures\r", done + 1, count, nFailed);
   }
-  return true;
+  muteErrors = false;
+
+  double elapsed = (now() - begin) / 1e9;
+  fprintf(stderr, "%d operations in %.2f s, %d failed\n", done, elapsed,
+          nFailed);
+  for (int i = 0; i < N_FAILURES; i++)
+    if (byKind[i] > 0)
+      fprintf(stderr, "  %-22s %6d\n", failureNames[i], byKind[i]);
+  if (okTime > 0) {
+    double clean = okBytes / (okTime / 1e9), actual = okBytes / elapsed;
+    fprintf(stderr,
+            "Throughput %.1f KB/s, %.1f KB/s without failures (%.1f%% "
+            "lost)\n",
+            actual / 1024, clean / 1024, 100 * (1 - actual / clean));
+  }
+  printLatencies("detection", detect, nFailed);
+  printLatencies("recovery", recover, nFailed);
+  free(detect);
+  free(recover);
+  if (done < count)
+    exit(1);
 }
 
-void readROM(const char *filename, uint8_t mem, int size) {
-  uint8_t buf[PAGE_SIZE];
-  FILE *f = fopen(filename, "wb");
-  if (f == NULL) {
-    fprintf(stderr, "Cannot write to file %s\n", filename);
+// Clone mode: the target on the -p programmer is copied to the targets on
+// the --clone ones. Destinations are mass erased, then each page of the
+// source is sent to all of them as soon as it arrives from the stream, and
+// all of them program it at the same time.
+#define MAX_DESTS 8
+
+typedef struct {
+  const char *name;
+  struct sp_port *port;
+  uint32_t uid;
+  const uint8_t *config;
+} Programmer;
+
+Programmer source, dests[MAX_DESTS], *active;
+int nDests = 0;
+uint8_t cloneImage[MAX_FLASH_SIZE];
+
+// the programmer the next commands go to, retries included
+void useProgrammer(Programmer *p) {
+  active->config = expectedConfig;
+  active = p;
+  port = p->port;
+  targetUid = p->uid;
+  expectedConfig = p->config;
+}
+
+void addDest(const char *name) {
+  if (nDests == MAX_DESTS) {
+    fprintf(stderr, "Too many clone destinations, at most %d are allowed\n",
+            MAX_DESTS);
     exit(1);
   }
-  for (int i = 0; i < size; i += PAGE_SIZE) {
-    if (!readBlock(mem, i, PAGE_SIZE, buf)) {
-      fclose(f);
-      exit(1);
+  dests[nDests++].name = name;
+}
+
+// The page is sent to all destinations before any status is read, a
+// destination which fails is then brought back and written on its own
+void clonePage(int offset, uint8_t buf[PAGE_SIZE], void *ctx) {
+  uint8_t mem = *(uint8_t *)ctx;
+  int page = (memBase(mem) + offset) / PAGE_SIZE;
+  uint8_t cmd[5] = {'P', mem, offset >> 16, offset >> 8, offset};
+
+  memcpy(cloneImage + page * PAGE_SIZE, buf, PAGE_SIZE);
+  if (isBlank(buf, PAGE_SIZE))
+    return;
+  for (int i = 0; i < nDests; i++) {
+    useProgrammer(&dests[i]);
+    portWrite(cmd, sizeof cmd);
+    portWrite(buf, PAGE_SIZE);
+    metrics.bytesWritten += PAGE_SIZE;
+  }
+  target[page] = cloneImage + page * PAGE_SIZE;
+  for (int i = 0; i < nDests; i++) {
+    useProgrammer(&dests[i]);
+    if (!readStatus()) {
+      int attempt = 0;
+      if (!retry(&attempt))
+        exit(1);
+      runPageOpRetry(ERASE_PROGRAM, page);
     }
-    if (!quiet && isatty(fileno(stdout)))
-      printf("Read: %5d\r", i);
-    fwrite(buf, 1, PAGE_SIZE, f);
   }
+  if (!quiet && isatty(fileno(stdout)))
+    printf("Clone: %5d\r", page * PAGE_SIZE);
+  useProgrammer(&source);
+}
+
+bool cloneBad[MAX_PAGES];
+
+void verifyPage(int offset, uint8_t buf[PAGE_SIZE], void *ctx) {
+  int page = (memBase(*(uint8_t *)ctx) + offset) / PAGE_SIZE;
+
+  cloneBad[page] = memcmp(buf, cloneImage + page * PAGE_SIZE, PAGE_SIZE) != 0;
+}
+
+// pages may have been hit by a command garbled during a failure, they are
+// rewritten once
+void verifyDest(const Programmer *p, int failed) {
+  uint8_t buf[PAGE_SIZE], mems[] = {'L', 'A'};
+  int sizes[] = {ldromSize, apromSize};
+
+  for (int i = 0; i < 2; i++)
+    streamPages(mems[i], 0, sizes[i], verifyPage, &mems[i]);
+  for (int i = 0; i < (apromSize + ldromSize) / PAGE_SIZE; i++) {
+    int address;
+    uint8_t mem = pageMem(i, &address);
+    if (!cloneBad[i] ||
+        readPageMatches(mem, address, buf, cloneImage + i * PAGE_SIZE))
+      continue;
+    metrics.verifyFailures++;
+    if (failures > failed) {
+      target[i] = cloneImage + i * PAGE_SIZE;
+      runPageOpRetry(ERASE_PROGRAM, i);
+      readPageRetry(mem, address, buf);
+    }
+    if (failures == failed ||
+        memcmp(buf, cloneImage + i * PAGE_SIZE, PAGE_SIZE) != 0) {
+      fprintf(stderr, "Verify failed on %s\n", p->name);
+      exit(3);
+    }
+  }
+}
+
+void cloneTargets() {
+  static uint8_t unlocked[sizeof config];
+  uint8_t mems[] = {'L', 'A'};
+  int sizes[] = {ldromSize, apromSize};
+  uint16_t devid;
+  int failed = failures;
+
+  source.port = port;
+  source.uid = targetUid;
+  source.config = config;
+  active = &source;
+  memcpy(unlocked, config, sizeof config);
+  unlocked[0] |= CONFIG0_LOCK;
+  for (int i = 0; i < nDests; i++) {
+    dests[i].port = openPort(dests[i].name);
+    useProgrammer(&dests[i]);
+    if (!readIdent(&devid, &dests[i].uid))
+      exit(2);
+    if (devid != device->devid) {
+      fprintf(stderr, "Target on %s is not a %s (device id %04X)\n",
+              dests[i].name, device->name, devid);
+      exit(2);
+    }
+    if (!quiet)
+      fprintf(stderr, "Cloning to %s (UID %06X)\n", dests[i].name,
+              dests[i].uid);
+  }
+
+  // erases run at the same time, then CONFIG is written, from which each
+  // programmer takes the LDROM size; the lock is applied only after the
+  // destinations have been verified
+  for (int i = 0; i < nDests; i++) {
+    useProgrammer(&dests[i]);
+    portWrite("X", 1);
+  }
+  for (int i = 0; i < nDests; i++) {
+    useProgrammer(&dests[i]);
+    if (!readStatus()) {
+      int attempt = 0;
+      if (!retry(&attempt))
+        exit(1);
+      massErase();
+    }
+    writeConfig(unlocked);
+  }
+
+  useProgrammer(&source);
+  for (int i = 0; i < 2; i++)
+    streamPages(mems[i], 0, sizes[i], clonePage, &mems[i]);
+
+  for (int i = 0; i < nDests; i++) {
+    useProgrammer(&dests[i]);
+    verifyDest(&dests[i], failed);
+    if (memcmp(unlocked, config, sizeof config) != 0)
+      writeConfig(config);
+  }
+  useProgrammer(&source);
+  if (!quiet)
+    fprintf(stderr, "Cloned %d KB to %d targets\n",
+            (apromSize + ldromSize) / 1024, nDests);
+}
+
+// --metrics: a file ending in .prom is kept as a Prometheus textfile with
+// counters summed over the runs, anything else gets a JSON line per run
+const char *metricsFile = NULL, *operation;
+int boards = 0; // programmed by this run
+bool completed = false;
+
+#define MAX_SERIES 256
+struct {
+  char key[128];
+  double value;
+} series[MAX_SERIES];
+int nSeries = 0;
+
+void loadSeries(const char *filename) {
+  char line[256];
+  FILE *f = fopen(filename, "r");
+
+  if (f == NULL)
+    return;
+  while (nSeries < MAX_SERIES && fgets(line, sizeof line, f) != NULL)
+    if (line[0] != '#' && sscanf(line, "%127s %lf", series[nSeries].key,
+                                 &series[nSeries].value) == 2)
+      nSeries++;
   fclose(f);
 }
 
-void writeROM(const char *filename, uint8_t mem) {
-  uint8_t buf[PAGE_SIZE], buf1[PAGE_SIZE];
-  FILE *f = fopen(filename, "rb");
+double oldSeries(const char *key) {
+  for (int i = 0; i < nSeries; i++)
+    if (strcmp(series[i].key, key) == 0)
+      return series[i].value;
+  return 0;
+}
+
+void promFamily(FILE *f, const char *name, const char *type,
+                const char *help) {
+  fprintf(f, "# HELP nuvoflash_%s %s\n# TYPE nuvoflash_%s %s\n", name, help,
+          name, type);
+}
+
+// writes the counter as the sum of its previous value and delta
+void promCounter(FILE *f, const char *fmt, const char *label, double delta) {
+  char key[128];
+
+  snprintf(key, sizeof key, fmt, label);
+  fprintf(f, "%s %.17g\n", key, oldSeries(key) + delta);
+}
+
+void writeProm(double seconds) {
+  char tmp[MAX_PATH + 4], key[128];
+  const char *results[] = {"ok", "failed"};
+  const char *ops[] = {"read", "write", "mass_erase", "diff", "soak", "clone"};
+  double t = time(NULL), first;
+  FileLock lock;
+
+  // runs ending together on a station would lose each other's increments
+  if (!lockFile(metricsFile, &lock))
+    return;
+  loadSeries(metricsFile);
+  snprintf(tmp, sizeof tmp, "%s.tmp", metricsFile);
+  FILE *f = fopen(tmp, "w");
+  if (f == NULL) {
+    fprintf(stderr, "Cannot write to file %s\n", tmp);
+    unlockFile(lock);
+    return;
+  }
+  promFamily(f, "runs_total", "counter", "Runs by operation and result");
+  for (int i = 0; i < sizeof ops / sizeof *ops; i++)
+    for (int j = 0; j < 2; j++) {
+      snprintf(key, sizeof key, "nuvoflash_runs_total{operation=\"%s\",",
+               ops[i]);
+      promCounter(f, strcat(key, "result=\"%s\"}"), results[j],
+                  strcmp(ops[i], operation) == 0 && completed == (j == 0));
+    }
+  promFamily(f, "boards_total", "counter", "Boards programmed");
+  for (int j = 0; j < 2; j++)
+    promCounter(f, "nuvoflash_boards_total{result=\"%s\"}", results[j],
+                completed == (j == 0) ? boards : 0);
+  promFamily(f, "bytes_read_total", "counter", "Flash bytes read");
+  promCounter(f, "nuvoflash_bytes_read_total%s", "", metrics.bytesRead);
+  promFamily(f, "bytes_written_total", "counter", "Flash bytes written");
+  promCounter(f, "nuvoflash_bytes_written_total%s", "", metrics.bytesWritten);
+  promFamily(f, "failures_total", "counter",
+             "Failed commands, each recovered with one or more retries");
+  promCounter(f, "nuvoflash_failures_total%s", "", failures);
+  promFamily(f, "retries_total", "counter", "Retries of failed commands");
+  promCounter(f, "nuvoflash_retries_total%s", "", retries);
+  promFamily(f, "target_not_responding_total", "counter",
+             "Replies with error 255, target not responding");
+  promCounter(f, "nuvoflash_target_not_responding_total%s", "",
+              metrics.noTarget);
+  promFamily(f, "verify_failures_total", "counter",
+             "Pages or CONFIG found different from what was written");
+  promCounter(f, "nuvoflash_verify_failures_total%s", "",
+              metrics.verifyFailures);
+
+  promFamily(f, "command_duration_seconds", "histogram",
+             "Latency of the commands sent to the programmer");
+  for (int op = 0; op < N_OPS; op++) {
+    uint64_t n = 0;
+    for (int i = 0; i <= N_BUCKETS; i++) {
+      char le[64];
+      if (i < N_BUCKETS) {
+        n += metrics.hist[op][i];
+        snprintf(le, sizeof le, "%s\",le=\"%g", opNames[op], buckets[i]);
+      } else {
+        n = metrics.count[op];
+        snprintf(le, sizeof le, "%s\",le=\"+Inf", opNames[op]);
+      }
+      promCounter(f, "nuvoflash_command_duration_seconds_bucket{op=\"%s\"}",
+                  le, n);
+    }
+    promCounter(f, "nuvoflash_command_duration_seconds_sum{op=\"%s\"}",
+                opNames[op], metrics.sum[op]);
+    promCounter(f, "nuvoflash_command_duration_seconds_count{op=\"%s\"}",
+                opNames[op], metrics.count[op]);
+  }
+
+  // boards per hour since the file was started, rate() over
+  // nuvoflash_boards_total gives it for any other window
+  first = oldSeries("nuvoflash_first_run_timestamp_seconds");
+  if (first == 0)
+    first = t - seconds;
+  snprintf(key, sizeof key, "nuvoflash_boards_total{result=\"ok\"}");
+  double ok = oldSeries(key) + (completed ? boards : 0);
+  promFamily(f, "first_run_timestamp_seconds", "gauge",
+             "Start of the first run counted in this file");
+  fprintf(f, "nuvoflash_first_run_timestamp_seconds %.0f\n", first);
+  promFamily(f, "last_run_timestamp_seconds", "gauge", "End of the last run");
+  fprintf(f, "nuvoflash_last_run_timestamp_seconds %.0f\n", t);
+  promFamily(f, "last_run_duration_seconds", "gauge",
+             "Wall time of the last run");
+  fprintf(f, "nuvoflash_last_run_duration_seconds %.3f\n", seconds);
+  promFamily(f, "boards_per_hour", "gauge",
+             "Boards programmed per hour since the first run");
+  fprintf(f, "nuvoflash_boards_per_hour %.1f\n",
+          t > first ? ok * 3600 / (t - first) : 0);
+
+  // renamed into place so that the collector never sees a partial file
+  if (fclose(f) != 0) {
+    fprintf(stderr, "Cannot write to file %s\n", tmp);
+    remove(tmp);
+    unlockFile(lock);
+    return;
+  }
+#ifdef _WIN32
+  if (!MoveFileExA(tmp, metricsFile, MOVEFILE_REPLACE_EXISTING))
+#else
+  if (rename(tmp, metricsFile) != 0)
+#endif
+    fprintf(stderr, "Cannot write to file %s\n", metricsFile);
+  unlockFile(lock);
+}
+
+// the line is written with a single call on a file opened for appending, so
+// that lines of runs on the same station do not interleave
+void writeJson(double seconds) {
+  char line[4096];
+  int n = snprintf(
+      line, sizeof line,
+      "{\"time\":%lld,\"operation\":\"%s\",\"result\":\"%s\","
+      "\"uid\":\"%06X\",\"seconds\":%.3f,\"boards\":%d,"
+      "\"bytes_read\":%llu,\"bytes_written\":%llu,\"failures\":%d,"
+      "\"retries\":%d,\"target_not_responding\":%d,"
+      "\"verify_failures\":%d,\"le\":[",
+      (long long)time(NULL), operation, completed ? "ok" : "failed", targetUid,
+      seconds, completed ? boards : 0, (unsigned long long)metrics.bytesRead,
+      (unsigned long long)metrics.bytesWritten, failures, retries,
+      metrics.noTarget, metrics.verifyFailures);
+  for (int i = 0; i < N_BUCKETS; i++)
+    n += snprintf(line + n, sizeof line - n, "%s%g", i ? "," : "", buckets[i]);
+  n += snprintf(line + n, sizeof line - n, "],\"commands\":{");
+  for (int op = 0, sep = 0; op < N_OPS; op++) {
+    if (metrics.count[op] == 0)
+      continue;
+    n += snprintf(line + n, sizeof line - n,
+                  "%s\"%s\":{\"count\":%llu,\"sum\":%.6f,\"buckets\":[",
+                  sep++ ? "," : "", opNames[op],
+                  (unsigned long long)metrics.count[op], metrics.sum[op]);
+    for (int i = 0; i < N_BUCKETS; i++)
+      n += snprintf(line + n, sizeof line - n, "%s%llu", i ? "," : "",
+                    (unsigned long long)metrics.hist[op][i]);
+    n += snprintf(line + n, sizeof line - n, "]}");
+  }
+  n += snprintf(line + n, sizeof line - n, "}}\n");
+
+  FILE *f = fopen(metricsFile, "a");
+  if (f == NULL || fwrite(line, 1, n, f) != n || fclose(f) != 0)
+    fprintf(stderr, "Cannot write to file %s\n", metricsFile);
+}
+
+uint64_t begin;
+
+// runs at exit, failed runs included
+void writeMetrics() {
+  double seconds = (now() - begin) / 1e9;
+  size_t len = strlen(metricsFile);
+
+  if (len > 5 && strcmp(metricsFile + len - 5, ".prom") == 0)
+    writeProm(seconds);
+  else
+    writeJson(seconds);
+}
+
+// Job files: a station with several programmers works through a queue of
+// jobs, one per line, each a selector followed by the options of a nuvoflash
+// run, e.g.
+//   programmer /dev/ttyACM0
+//   programmer /dev/ttyACM1
+//   * -w APROM fw.bin -S 0x3F00:4:serial.txt
+//   /dev/ttyACM1 -w CONFIG 7FFEFFFFFF
+// The selector is * for any programmer or the port of the one the job must
+// run on. Each job is run by a copy of nuvoflash on its programmer. Jobs for
+// any programmer are dealt out in turn, a programmer whose own queue is empty
+// takes one from the back of the longest queue, so none stays idle while
+// there is work it could do. Jobs sharing a -S counter only lock it while
+// they take their number, before writing, and then run in parallel.
+#define MAX_JOBS 256
+#define MAX_JOB_ARGS 32
+#define MAX_WORKERS 16
+
+typedef struct {
+  char *args[MAX_JOB_ARGS + 5]; // argv of the nuvoflash run
+  int line, worker;             // -1: any programmer
+  const char *selector;
+} Job;
+
+typedef struct {
+  char *port;
+  int queue[MAX_JOBS], head, tail;
+  int job; // running, -1 when idle
+  long pid;
+  uint64_t start, busy;
+  int done, stolen, failed;
+} Worker;
+
+Job jobs[MAX_JOBS];
+Worker workers[MAX_WORKERS];
+int nJobs = 0, nWorkers = 0, running = 0, jobStatus = 0;
+
+void readJobs(const char *filename) {
+  char line[1024];
+  int n = 0, next = 0;
+  FILE *f = fopen(filename, "r");
+
   if (f == NULL) {
     fprintf(stderr, "Cannot read from file %s\n", filename);
     exit(1);
   }
-  for (int verify = 0; verify <= 1; verify++) {
-    fseek(f, 0, SEEK_SET);
-    for (int i = 0; i < 18 * 1024; i += PAGE_SIZE) {
-      memset(buf, 0xFF, sizeof buf);
-      int n = fread(buf, 1, PAGE_SIZE, f);
-      if (n == 0)
-        break;
-      if (!quiet && isatty(fileno(stdout)))
-        printf("%s: %5d\r", verify ? "Verify" : "Write", i);
-      bool ok;
-      if (verify) {
-        ok = readBlock(mem, i, PAGE_SIZE, buf1);
-        if (ok)
-          if (0 != memcmp(buf, buf1, PAGE_SIZE)) {
-            fputs("Verify failed\n", stderr);
-            exit(3);
-          }
-      } else
-        ok = writeBlock(mem, i, PAGE_SIZE, buf);
-      if (!ok) {
-        fclose(f);
+  while (fgets(line, sizeof line, f) != NULL) {
+    char *args[MAX_JOB_ARGS + 2], *p = strchr(line, '#');
+    int argc = 0;
+    n++;
+    if (p != NULL)
+      *p = 0;
+    for (p = strtok(line, " \t\r\n"); p != NULL; p = strtok(NULL, " \t\r\n")) {
+      if (argc == MAX_JOB_ARGS + 1) {
+        fprintf(stderr, "Too many arguments on line %d of %s\n", n, filename);
         exit(1);
       }
-      if (n != PAGE_SIZE)
-        break;
+      args[argc++] = strdup(p);
+    }
+    if (argc == 0)
+      continue;
+    if (strcmp(args[0], "programmer") == 0) {
+      if (argc != 2 || nWorkers == MAX_WORKERS) {
+        fprintf(stderr, "Invalid programmer on line %d of %s, at most %d "
+                "are allowed\n", n, filename, MAX_WORKERS);
+        exit(1);
+      }
+      workers[nWorkers++].port = args[1];
+      continue;
     }
+    if (argc == 1 || nJobs == MAX_JOBS) {
+      fprintf(stderr, "Invalid job on line %d of %s, at most %d are "
+              "allowed\n", n, filename, MAX_JOBS);
+      exit(1);
+    }
+    Job *job = &jobs[nJobs++];
+    job->line = n;
+    job->selector = args[0];
+    // the port comes from the scheduler, the file name must stay last
+    job->args[1] = "-q";
+    job->args[2] = "-p";
+    for (int i = 1; i < argc; i++) {
+      if (strcmp(args[i], "-p") == 0 || strncmp(args[i], "--port", 6) == 0 ||
+          strncmp(args[i], "--jobs", 6) == 0 || strcmp(args[i], "-J") == 0) {
+        fprintf(stderr, "%s is not allowed in a job (line %d of %s)\n",
+                args[i], n, filename);
+        exit(1);
+      }
+      job->args[i + 3] = args[i];
+    }
+    job->args[argc + 3] = NULL;
   }
   fclose(f);
+  if (nWorkers == 0 || nJobs == 0) {
+    fprintf(stderr, "%s must list at least a programmer and a job\n",
+            filename);
+    exit(1);
+  }
+
+  for (int i = 0; i < nJobs; i++) {
+    Job *job = &jobs[i];
+    Worker *w;
+    job->worker = -1;
+    if (strcmp(job->selector, "*") == 0)
+      w = &workers[next++ % nWorkers];
+    else {
+      for (int j = 0; j < nWorkers; j++)
+        if (strcmp(job->selector, workers[j].port) == 0)
+          job->worker = j;
+      if (job->worker < 0) {
+        fprintf(stderr, "Job on line %d is for %s, which is not a "
+                "programmer\n", job->line, job->selector);
+        exit(1);
+      }
+      w = &workers[job->worker];
+    }
+    w->queue[w->tail++] = i;
+  }
 }
 
-void readAPROM(const char *filename, int size) { readROM(filename, 'A', size); }
+int stealable(const Worker *w) {
+  int n = 0;
+  for (int i = w->head; i < w->tail; i++)
+    n += jobs[w->queue[i]].worker < 0;
+  return n;
+}
 
-void readLDROM(const char *filename, int size) { readROM(filename, 'L', size); }
+// the front of the worker's own queue, or the last job for any programmer
+// in the longest of the others
+int nextJob(Worker *w) {
+  Worker *victim = NULL;
+  int most = 0;
 
-void writeAPROM(const char *filename, int apromSize) {
-  struct stat st;
-  stat(filename, &st);
-  if (st.st_size > apromSize) {
-    fprintf(stderr, "File is too big, APROM size is %d\n", apromSize);
-    exit(1);
+  if (w->head < w->tail)
+    return w->queue[w->head++];
+  for (int i = 0; i < nWorkers; i++) {
+    int n = stealable(&workers[i]);
+    if (n > most) {
+      most = n;
+      victim = &workers[i];
+    }
   }
-  writeROM(filename, 'A');
+  if (victim == NULL)
+    return -1;
+  for (int i = victim->tail - 1;; i--)
+    if (jobs[victim->queue[i]].worker < 0) {
+      int job = victim->queue[i];
+      memmove(victim->queue + i, victim->queue + i + 1,
+              (--victim->tail - i) * sizeof *victim->queue);
+      w->stolen++;
+      return job;
+    }
 }
 
-void writeLDROM(const char *filename, int ldromSize) {
-  struct stat st;
-  stat(filename, &st);
-  if (st.st_size > ldromSize) {
-    fprintf(stderr, "File is too big, LDROM size is %d\n", ldromSize);
-    exit(1);
-  }
-  writeROM(filename, 'L');
-}
+void finishJob(Worker *w, int status) {
+  Job *job = &jobs[w->job];
+  uint64_t t = now() - w->start;
 
-void readConfig(uint8_t cfg[]) {
-  if (!readBlock('C', 0, 5, cfg))
-    exit(2);
+  w->busy += t;
+  w->done++;
+  if (status != 0) {
+    w->failed++;
+    if (status > jobStatus)
+      jobStatus = status;
+    fprintf(stderr, "Job on line %d failed on %s (exit code %d)\n",
+            job->line, w->port, status);
+  } else if (!quiet)
+    fprintf(stderr, "Job on line %d done on %s in %.2f s\n", job->line,
+            w->port, t / 1e9);
+  w->job = -1;
 }
 
-void printConfig(uint8_t cfg[]) {
-  for (int i = 0; i < 5; i++)
-    printf("%02X", cfg[i]);
-  putchar('\n');
+// Windows has no way to wait for whichever copy ends first, there the jobs
+// are run one at a time
+void startJob(Worker *w, int job, const char *self) {
+  Job *j = &jobs[job];
+
+  j->args[0] = (char *)self;
+  j->args[3] = w->port;
+  w->job = job;
+  w->start = now();
+#ifdef _WIN32
+  int status = _spawnvp(_P_WAIT, self, (const char *const *)j->args);
+  finishJob(w, status < 0 ? 1 : status);
+#else
+  fflush(stderr);
+  pid_t pid = fork();
+  if (pid == 0) {
+    execvp(self, j->args);
+    fprintf(stderr, "Cannot run %s\n", self);
+    _exit(1);
+  } else if (pid < 0) {
+    fputs("Cannot start job\n", stderr);
+    exit(1);
+  }
+  w->pid = pid;
+  running++;
+#endif
 }
 
-void writeConfig(const uint8_t cfg[]) {
-  uint8_t buf[5];
-  if (!writeBlock('C', 0, 5, cfg))
-    exit(2);
-  readConfig(buf);
-  if (0 != memcmp(cfg, buf, 5)) {
-    fputs("Verify failed\n", stderr);
-    exit(3);
+#ifndef _WIN32
+void reapJob() {
+  int status;
+  pid_t pid = wait(&status);
+
+  if (pid < 0) {
+    fputs("Lost track of the running jobs\n", stderr);
+    exit(1);
   }
+  for (int i = 0; i < nWorkers; i++)
+    if (workers[i].job >= 0 && workers[i].pid == pid) {
+      running--;
+      finishJob(&workers[i], WIFEXITED(status) ? WEXITSTATUS(status) : 1);
+    }
 }
+#endif
 
-void massErase() {
-  uint8_t err;
+// the copies are started from the executable itself, argv[0] may be a
+// relative path from another directory or a wrapper
+const char *selfPath(const char *argv0) {
+  static char path[4096];
+#ifdef _WIN32
+  DWORD n = GetModuleFileNameA(NULL, path, sizeof path);
+#else
+  ssize_t n = readlink("/proc/self/exe", path, sizeof path);
+#endif
+  if (n <= 0 || n >= sizeof path)
+    return argv0;
+  path[n] = 0;
+  return path;
+}
 
-  sp_blocking_write(port, "X", 1, 500);
+int runJobs(const char *filename, const char *self) {
+  uint64_t t0 = now();
 
-  if (sp_blocking_read(port, &err, 1, 500) != 1) {
-    fprintf(stderr, "Programmer is not responding\n");
-    exit(1);
+  readJobs(filename);
+  for (int i = 0; i < nWorkers; i++)
+    workers[i].job = -1;
+  for (;;) {
+    bool started = false;
+    for (int i = 0; i < nWorkers; i++) {
+      int job;
+      if (workers[i].job < 0 && (job = nextJob(&workers[i])) >= 0) {
+        startJob(&workers[i], job, self);
+        started = true;
+      }
+    }
+    if (running == 0 && !started)
+      break;
+#ifndef _WIN32
+    if (running > 0)
+      reapJob();
+#endif
   }
-  if (err != 0) {
-    if (err == 255)
-      fputs("Target board nor responding\n", stderr);
-    else
-      fprintf(stderr, "Programmer returned error code %d\n", err);
-    exit(1);
+
+  double elapsed = (now() - t0) / 1e9;
+  int width = strlen("programmer");
+  for (int i = 0; i < nWorkers; i++)
+    if (strlen(workers[i].port) > width)
+      width = strlen(workers[i].port);
+  fprintf(stderr, "%-*s %5s %6s %6s %9s %9s %6s\n", width, "programmer",
+          "jobs", "stolen", "failed", "busy s", "idle s", "util");
+  for (int i = 0; i < nWorkers; i++) {
+    Worker *w = &workers[i];
+    double busy = w->busy / 1e9;
+    fprintf(stderr, "%-*s %5d %6d %6d %9.2f %9.2f %5.1f%%\n", width,
+            w->port, w->done, w->stolen, w->failed, busy, elapsed - busy,
+            100 * busy / elapsed);
   }
+  fprintf(stderr, "%d jobs in %.2f s\n", nJobs, elapsed);
+  return jobStatus;
 }
 
 int main(int argc, char *argv[]) {
   Mem mem;
   char opt;
-  int opt_index, ldromSize = 0, apromSize = 18 * 1024;
+  int opt_index;
+  uint16_t devid;
   uint8_t buf[PAGE_SIZE];
-  char portName[20] = "";
-  bool portOpt = false, readOpt = false, writeOpt = false, massEraseOpt = false;
-  uint8_t cfg[5];
+  char portName[MAX_PATH] = "";
+  bool portOpt = false, readOpt = false, writeOpt = false, massEraseOpt = false,
+       diffOpt = false, soakOpt = false, cloneOpt = false;
+  int soakCount = 0;
+  const char *jobsFile = NULL;
   static struct option long_options[] = {
       {"quiet", no_argument, NULL, 'q'},
       {"port", required_argument, NULL, 'p'},
       {"read", required_argument, NULL, 'r'},
       {"write", required_argument, NULL, 'w'},
       {"massErase", no_argument, NULL, 'x'},
+      {"diff", required_argument, NULL, 'd'},
+      {"journal", required_argument, NULL, 'j'},
+      {"patch", required_argument, NULL, 'P'},
+      {"patch-file", required_argument, NULL, 'F'},
+      {"serial", required_argument, NULL, 'S'},
+      {"touched-only", no_argument, NULL, 'T'},
+      {"capture", required_argument, NULL, 'c'},
+      {"bench", no_argument, NULL, 'b'},
+      {"dry-run", no_argument, NULL, 'n'},
+      {"soak", required_argument, NULL, 'k'},
+      {"clone", required_argument, NULL, 'C'},
+      {"metrics", required_argument, NULL, 'm'},
+      {"isp", no_argument, NULL, 'u'},
+      {"jobs", required_argument, NULL, 'J'},
       {0, 0, 0, 0}};
-  clock_t begin = clock();
+  begin = now();
+  double phases[N_PHASES];
 
-  while ((opt = getopt_long(argc, argv, "qp:r:w:x", long_options,
-                            &opt_index)) != -1) {
+  while ((opt = getopt_long(argc, argv, "qp:r:w:xd:j:P:F:S:Tc:bnk:C:m:uJ:",
+                            long_options, &opt_index)) != -1) {
     switch (opt) {
     case 'q':
       quiet = true;
       break;
     case 'p':
-      strncpy(portName, optarg, sizeof portName - 1);
+      if (strlen(optarg) >= sizeof portName) {
+        fprintf(stderr, "Port name %s is too long\n", optarg);
+        exit(1);
+      }
+      strcpy(portName, optarg);
+      portOpt = true;
       break;
     case 'r':
       readOpt = true;
@@ -272,62 +2603,161 @@ int main(int argc, char *argv[]) {
     case 'x':
       massEraseOpt = true;
       break;
+    case 'd':
+      diffOpt = true;
+      mem = memFromString(optarg);
+      break;
+    case 'j':
+      journalDir = optarg;
+      break;
+    case 'P':
+      if (!parsePatch(optarg, '=')) {
+        fprintf(stderr, "Invalid patch '%s', expected <addr>=<hex>\n", optarg);
+        usage();
+      }
+      break;
+    case 'F':
+      readPatchFile(optarg);
+      break;
+    case 'S':
+      parseSerial(optarg);
+      break;
+    case 'T':
+      touchedOnly = true;
+      break;
+    case 'c':
+      captureOpen(optarg);
+      break;
+    case 'b':
+      bench = true;
+      break;
+    case 'n':
+      dryRun = true;
+      break;
+    case 'C':
+      cloneOpt = true;
+      addDest(optarg);
+      break;
+    case 'm':
+      metricsFile = optarg;
+      break;
+    case 'u':
+      isp = true;
+      break;
+    case 'J':
+      jobsFile = optarg;
+      break;
+    case 'k':
+      soakOpt = true;
+      soakCount = atoi(optarg);
+      if (soakCount <= 0)
+        usage();
+      break;
     default:
       usage();
     }
   }
 
-  if (!readOpt && !writeOpt && !massEraseOpt) {
-    fputs("Exactly one of read, write, erase must be specified\n", stderr);
+  if (jobsFile != NULL) {
+    if (readOpt + writeOpt + massEraseOpt + diffOpt + soakOpt + cloneOpt +
+            portOpt + isp > 0 ||
+        optind != argc) {
+      fputs("The operations and ports of --jobs come from the job file\n",
+            stderr);
+      usage();
+    }
+    exit(runJobs(jobsFile, selfPath(argv[0])));
+  }
+  if (readOpt + writeOpt + massEraseOpt + diffOpt + soakOpt + cloneOpt == 0) {
+    fputs("Exactly one of read, write, erase, diff, soak, clone must be "
+          "specified\n",
+          stderr);
+    usage();
+  } else if (readOpt + writeOpt + massEraseOpt + diffOpt + soakOpt + cloneOpt > 1) {
+    fputs("Only one of read, write, erase, diff, soak, clone is allowed\n",
+          stderr);
     usage();
-  } else if ((readOpt && (writeOpt || massEraseOpt)) ||
-             (writeOpt && massEraseOpt)) {
-    fputs("Only one of read, write, erase is allowed\n", stderr);
+  }
+  if (diffOpt && mem == CONFIG) {
+    fputs("Only APROM and LDROM can be compared\n", stderr);
+    usage();
+  }
+  if (isp && (!writeOpt || mem != APROM || journalDir != NULL || touchedOnly ||
+              dryRun)) {
+    fputs("ISP can only write APROM, without -j, -T or -n\n", stderr);
     usage();
   }
 
-  if (!massEraseOpt && (mem != CONFIG || writeOpt) && argc != 1 &&
-      optind != argc - 1) {
+  if (!massEraseOpt && !soakOpt && !cloneOpt && (mem != CONFIG || writeOpt) &&
+      argc != 1 && optind != argc - 1) {
     fputs("Missing arguments\n", stderr);
     usage();
   }
+  operation = readOpt        ? "read"
+              : writeOpt     ? "write"
+              : massEraseOpt ? "mass_erase"
+              : diffOpt      ? "diff"
+              : soakOpt      ? "soak"
+                             : "clone";
+  // a board is counted when its APROM or LDROM is written, whether by ICP
+  // or ISP, not for a CONFIG change
+  if (writeOpt && !dryRun && mem != CONFIG)
+    boards = 1;
+  else if (cloneOpt)
+    boards = nDests;
+  if (metricsFile != NULL)
+    atexit(writeMetrics);
 
+  uint64_t t = now();
   if (!portOpt) {
     if (!selectSerialPort(sizeof portName - 1, portName)) {
       fputs("Serial port not found, try using the -p/--port option\n", stderr);
       exit(1);
     }
   }
+  startupTime.discovery = (now() - t) / 1e9;
 
-  enum sp_return res = sp_get_port_by_name(portName, &port);
-  if (res != SP_OK) {
-    fputs("The serial port does not exist, exiting\n", stderr);
-    exit(1);
-  }
-  res = sp_open(port, SP_MODE_READ_WRITE);
-  if (res != SP_OK) {
-    fputs("Cannot open serial port, exiting\n", stderr);
-    exit(1);
-  }
-  res = sp_set_baudrate(port, 115200);
-  if (res != SP_OK) {
-    fputs("Cannot set baud rate, exiting\n", stderr);
-    exit(1);
+  t = now();
+  port = openPort(portName);
+  startupTime.open = (now() - t) / 1e9;
+
+  t = now();
+  bool gotConfig = true;
+  if (isp) {
+    if ((bench && !readPhases(phases)) || !ispConnect(&devid))
+      exit(2);
+  } else if (!firstCommands(&devid, phases, &gotConfig))
+    exit(2);
+  startupTime.first = (now() - t) / 1e9;
+  device = findDevice(devid);
+  if (device == NULL || device->pageSize != PAGE_SIZE ||
+      device->flashSize > MAX_FLASH_SIZE) {
+    fprintf(stderr, "Unsupported device id %04X\n", devid);
+    exit(2);
   }
+  if (!quiet && isp)
+    fprintf(stderr, "Target is %s (ISP bootloader)\n", device->name);
+  else if (!quiet)
+    fprintf(stderr, "Target is %s (UID %06X)\n", device->name, targetUid);
+  if (!gotConfig)
+    readConfig(config);
+  expectedConfig = config;
 
-  readConfig(cfg);
+  ldromSize = (7 - (config[1] & 7)) * device->ldromUnit;
+  if (ldromSize > device->ldromMax)
+    ldromSize = device->ldromMax;
+  apromSize = device->flashSize - ldromSize;
 
-  ldromSize = (7 - (cfg[1] & 7)) * 1024;
-  if (ldromSize > 4 * 1024)
-    ldromSize = 4 * 1024;
-  apromSize -= ldromSize;
+  // reserved once the target has answered, a run that cannot reach it
+  // does not use up a number
+  reserveSerial(writeOpt && !dryRun && mem != CONFIG);
 
   char *p, *end;
   unsigned long long l = 0;
   if (readOpt)
     switch (mem) {
     case CONFIG:
-      printConfig(cfg);
+      printConfig(config);
       break;
     case APROM:
       readAPROM(argv[argc - 1], apromSize);
@@ -357,17 +2787,37 @@ int main(int argc, char *argv[]) {
       writeConfig(buf);
       break;
     case APROM:
-      writeAPROM(argv[argc - 1], apromSize);
+      if (isp)
+        ispWriteAPROM(argv[argc - 1]);
+      else
+        writeAPROM(argv[argc - 1], apromSize);
       break;
     case LDROM:
       writeLDROM(argv[argc - 1], ldromSize);
     }
   else if (massEraseOpt)
     massErase();
+  else if (diffOpt)
+    diffROM(argv[argc - 1], mem == APROM ? 'A' : 'L',
+            mem == APROM ? apromSize : ldromSize);
+  else if (soakOpt)
+    soak(soakCount);
+  else if (cloneOpt)
+    cloneTargets();
 
+  if (bench && !readPhases(phases))
+    exit(1);
   sp_close(port);
+  if (capture != NULL)
+    fclose(capture);
+  if (failures > 0)
+    fprintf(stderr, "%d transient failures recovered with %d retries\n",
+            failures, retries);
+  completed = true;
   if (!quiet)
     fprintf(stderr, "Operation completed in %.2f seconds\n",
-            ((double)(clock() - begin)) / CLOCKS_PER_SEC);
+            (now() - begin) / 1e9);
+  if (bench)
+    printBench((now() - begin) / 1e9, phases);
   return 0;
 }
\ No newline at end of file
@@ -4,211 +4,65 @@
 #include "ch554.h"
 #include <stdbool.h>
 #include <stdint.h>
+#include <string.h>
 
 __sbit __at(0x90+4) P14;
 
-__sbit __at(0xB0+3) P33;
-__sbit __at(0xB0+4) P34;
-__sbit __at(0xB0+5) P35;
-
-#define dat_line GPIO_DAT
-#define rst_line GPIO_RST
-#define clk_line GPIO_CLK
-
-#define GPIO_DAT	33//20
-#define GPIO_CLK	34//26
-#define GPIO_RST	35//21
-
-#define N76E003_DEVID	0x3650
-#define NUVOTON_CID 0xDA
-#define FLASH_SIZE	(18 * 1024)
-#define LDROM_MAX_SIZE	(4 * 1024)
-
-#define APROM_FLASH_ADDR	0x0
-#define CFG_FLASH_ADDR		0x30000UL
-#define CFG_FLASH_LEN		5
-
-#define CMD_READ_UID		0x04
-#define CMD_READ_CID		0x0b
-#define CMD_READ_DEVICE_ID	0x0c
-#define CMD_READ_FLASH		0x00
-#define CMD_WRITE_FLASH		0x21
-#define CMD_MASS_ERASE		0x26
-#define CMD_PAGE_ERASE		0x22
-
-#define SLOW 52
-#define FAST 0
+#define STREAM_CHUNK 64 // one full speed bulk packet
+#define ISP_PACKET 64   // fixed size of Nuvoton ISP packets
+#define ISP_BAUD 115200
 
 #define TRIGGER 12
-
-__xdata int clkDelay=SLOW;
-
-#define usleep(x) delayMicroseconds(x)
-#define pgm_get_dat() (P33)
-#define pgm_set_rst(val) {P35=(val);}
-#define pgm_set_dat(val) {P33=(val);}
-#define pgm_set_clk(val) \
-  _Pragma("save")\
-  _Pragma("disable_warning 110")\
-  {P34=(val); if (clkDelay>0) usleep(clkDelay);}\
-  _Pragma("restore")
-#define pgm_dat_dir(val) \
-  _Pragma("save")\
-  _Pragma("disable_warning 126")\
-  {if (val) {P3_MOD_OC|=0x08;P3_DIR_PU|=0x8;} else {P3_MOD_OC&=~0x8;P3_DIR_PU&=~0x8;}}\
-  _Pragma("restore")
-#define pgm_deinit() pgm_set_rst(1)
-
-void icp_bitsend(__xdata uint32_t data, __xdata int len)
-{
-	/* configure DAT pin as output */
-	pgm_dat_dir(1);
-
-  uint32_t mask=1UL<<(len-1);
-	while (mask) {
-		pgm_set_dat((data & mask)!=0);
-		pgm_set_clk(1);
-    mask>>=1;
-		pgm_set_clk(0);
-	}
-}
-
-void icp_send_command(__xdata uint8_t cmd, __xdata uint32_t dat)
-{
-	icp_bitsend((dat << 6) | cmd, 24);
-}
-
-void icp_init(void)
-{
-	uint32_t icp_seq = 0xae1cb6;
-	int i = 24;
-
-	while (i--) {
-		pgm_set_rst((icp_seq >> i) & 1);
-		usleep(10000);
-	}
-
-	usleep(100);
-
-	icp_bitsend(0x5aa503, 24);
-}
-
-void icp_exit(void)
-{
-	pgm_set_rst(1);
-	usleep(5000);
-	pgm_set_rst(0);
-	usleep(10000);
-	icp_bitsend(0xf78f0, 24);
-	usleep(500);
-	pgm_set_rst(1);
-}
-
-uint8_t icp_read_byte(__xdata int end)
-{
-	pgm_dat_dir(0);
-
-	uint8_t data = 0;
-	int i = 8;
-
-	while (i--) {
-	  data<<=1;
-		data |= pgm_get_dat();
-		pgm_set_clk(1);
-		pgm_set_clk(0);
-	}
-
-	pgm_dat_dir(1);
-	pgm_set_dat(end);
-	pgm_set_clk(1);
-	pgm_set_clk(0);
-
-	return data;
-}
-
-void icp_write_byte(__xdata uint8_t data, __xdata int end, __xdata int delay1, __xdata int delay2)
+#define INSTRUMENT 1
+
+// Phases of the command processing timed by the instrumentation counters
+#define PH_IDLE 0       // waiting for a command
+#define PH_USB_RECV 1   // receiving command and data from the host
+#define PH_ICP_SEND 2   // ICP entry and commands
+#define PH_ICP_ERASE 3  // page/mass erase
+#define PH_ICP_RW 4     // flash data read/write
+#define PH_USB_SEND 5   // sending replies to the host
+#define N_PHASES 6
+
+#if INSTRUMENT
+// Timer2 runs free at Fsys/12, its overflows extend it to 32 bits
+__xdata volatile uint16_t t2Overflows;
+__xdata uint32_t phaseTicks[N_PHASES], phaseT0;
+__data uint8_t phase=PH_IDLE;
+
+void Timer2Interrupt(void) __interrupt(INT_NO_TMR2)
 {
-	icp_bitsend(data, 8);
-	pgm_set_dat(end);
-	usleep(delay1);
-	pgm_set_clk(1);
-	usleep(delay2);
-	pgm_set_dat(0);
-	pgm_set_clk(0);
+  TF2=0;
+  t2Overflows++;
 }
 
-uint16_t icp_read_device_id(void)
+uint32_t ticks(void)
 {
-	icp_send_command(CMD_READ_DEVICE_ID, 0);
-
-	uint8_t devid[2];
-	devid[0] = icp_read_byte(0);
-	devid[1] = icp_read_byte(1);
-
-	return (devid[1] << 8) | devid[0];
+  uint16_t hi;
+  uint8_t h, l;
+
+  do {
+    hi=t2Overflows;
+    h=TH2;
+    l=TL2;
+  } while (h!=TH2 || hi!=t2Overflows);
+  return ((uint32_t)hi<<16)|((uint16_t)h<<8)|l;
 }
 
-uint8_t icp_read_cid(void)
+void phaseSwitch(uint8_t p)
 {
-	icp_send_command(CMD_READ_CID, 0);
-	return icp_read_byte(1);
-}
-
-uint32_t icp_read_uid(void)
-{
-	uint8_t uid[3];
-
-	for (int i = 0; i < sizeof(uid); i++) {
-		icp_send_command(CMD_READ_UID, i);
-		uid[i] = icp_read_byte(1);
-	}
-
-	return ((uint32_t)uid[2] << 16) | (uid[1] << 8) | uid[0];
-}
-
-uint32_t icp_read_ucid(void)
-{
-	uint8_t ucid[4];
-
-	for (int i = 0; i < sizeof(ucid); i++) {
-		icp_send_command(CMD_READ_UID, i + 0x20);
-		ucid[i] = icp_read_byte(1);
-	}
-
-	return ((uint32_t)ucid[3] << 24) | ((uint32_t)ucid[2] << 16) | (ucid[1] << 8) | ucid[0];
-}
-
-uint32_t icp_read_flash(__xdata uint32_t addr, __xdata uint32_t len, __xdata uint8_t *__xdata data)
-{
-	icp_send_command(CMD_READ_FLASH, addr);
-
-	for (int i = 0; i < len; i++)
-		data[i] = icp_read_byte(i == (len-1));
-
-	return addr + len;
-}
-
-uint32_t icp_write_flash(__xdata uint32_t addr, __xdata uint32_t len, __xdata uint8_t *__xdata data)
-{
-	icp_send_command(CMD_WRITE_FLASH, addr);
-
-	for (int i = 0; i < len; i++)
-		icp_write_byte(data[i], i == (len-1), 200, 50);
-
-	return addr + len;
+  __xdata uint32_t t=ticks();
+  phaseTicks[phase]+=t-phaseT0;
+  phaseT0=t;
+  phase=p;
 }
 
-void icp_mass_erase(void)
-{
-	icp_send_command(CMD_MASS_ERASE, 0x3A5A5);
-	icp_write_byte(0xff, 1, 100000, 10000);
-}
+#define PHASE(p) phaseSwitch(p)
+#else
+#define PHASE(p)
+#endif
 
-void icp_page_erase(__xdata uint32_t addr)
-{
-	icp_send_command(CMD_PAGE_ERASE, addr);
-	icp_write_byte(0xff, 1, 10000, 1000);
-}
+#include "icp.h"
 
 void setup() {
   pinMode(14,OUTPUT);
@@ -218,8 +72,34 @@ void setup() {
   pinMode(TRIGGER,OUTPUT);
   digitalWrite(TRIGGER,LOW);
 #endif
+#if INSTRUMENT
+  T2MOD&=~(bTMR_CLK|bT2_CLK);
+  C_T2=0;
+  CP_RL2=0;
+  RCAP2L=RCAP2H=0;
+  TL2=TH2=0;
+  ET2=1;
+  TR2=1;
+#endif
 }
 
+#if INSTRUMENT
+void sendPhases(void) {
+  __xdata uint32_t v=F_CPU/12;
+
+  USBSerial_write(0);
+  for (uint8_t i=0;i<=N_PHASES;i++) {
+    USBSerial_write(v);
+    USBSerial_write(v>>8);
+    USBSerial_write(v>>16);
+    USBSerial_write(v>>24);
+    if (i<N_PHASES) v=phaseTicks[i];
+  }
+  memset(phaseTicks,0,sizeof phaseTicks);
+  phaseT0=ticks();
+}
+#endif
+
 void dump(uint8_t *p,size_t len) {
   for (int i=0;i<len;i++) {
     if (p[i]<16) USBSerial_print("0");
@@ -235,13 +115,101 @@ int readTimeout(int msTimeout) {
   while (millis()-t0<msTimeout) {
     if (USBSerial_available())
     return USBSerial_read();
+    icp_poll();
   }
   return -1;
 }
 
-bool inProg=false;
+bool inProg=false, ackPending=false;
 __xdata unsigned long tLastProg=0;
 __xdata int ldRomSize;
+__xdata uint16_t devId;
+__xdata uint8_t cId;
+
+// where LDROM pages go, from CONFIG1; kept up to date by the commands which
+// change CONFIG, as it is read only on entering ICP mode
+void setLdRomSize(uint8_t cfg1) {
+  ldRomSize=(7-(cfg1&7))*dev->ldromUnitKB*1024;
+  if (ldRomSize>dev->ldromMaxKB*1024) ldRomSize=dev->ldromMaxKB*1024;
+}
+
+// replies to a mass erase are held back until the erase is over, but a
+// following command must not overtake them
+void completePending(void) {
+  icp_wait();
+  if (ackPending) {
+    PHASE(PH_USB_SEND);
+    USBSerial_write(0);
+    ackPending=false;
+  }
+}
+
+// ISP bridge to the bootloader in the target's LDROM, over UART0 (P3.0 and
+// P3.1). 'B' resets the target, taking it out of ICP mode if needed, so that
+// the bootloader starts. 'U' is followed by a packet count, its complement,
+// a timeout in 10 ms units and the packets: each one is sent to the target
+// and answered with 0 and the target's reply, or 255 if the reply does not
+// come in time, after which the remaining packets are answered 255 without
+// being sent.
+void ispCommand(char cmd, __xdata uint8_t *buf) {
+  __data uint8_t n, i;
+  __xdata uint16_t timeout;
+  __xdata unsigned long t0;
+  bool ok=true;
+
+  if (cmd=='B') {
+    if (inProg) {
+      inProg=false;
+      icp_exit();
+      pgm_deinit();
+    }
+    PHASE(PH_ICP_SEND);
+    pgm_set_rst(0);
+    delay(10);
+    pgm_set_rst(1);
+    Serial0_begin(ISP_BAUD);
+    while (Serial0_available()) Serial0_read();
+    PHASE(PH_USB_SEND);
+    USBSerial_write(0);
+    return;
+  }
+
+  int count=readTimeout(1000), check=readTimeout(1000), t=readTimeout(1000);
+  if (count<0 || check<0 || t<0) return;
+  // with a byte of the header lost the packets would be taken for commands,
+  // they are thrown away instead
+  if ((count^check)!=0xFF) {
+    while (readTimeout(100)>=0);
+    return;
+  }
+  n=count;
+  timeout=t*10;
+  while (n--) {
+    PHASE(PH_USB_RECV);
+    for (i=0;i<ISP_PACKET;i++) {
+      int c=readTimeout(1000);
+      if (c<0) return;
+      buf[i]=c;
+    }
+    if (ok) {
+      PHASE(PH_ICP_RW); // target traffic, at UART instead of ICP speed
+      for (i=0;i<ISP_PACKET;i++)
+        Serial0_write(buf[i]);
+      t0=millis();
+      for (i=0;i<ISP_PACKET && millis()-t0<timeout;)
+        if (Serial0_available()) buf[i++]=Serial0_read();
+      ok=i==ISP_PACKET;
+    }
+    PHASE(PH_USB_SEND);
+    if (!ok) {
+      USBSerial_write(255);
+      continue;
+    }
+    USBSerial_write(0);
+    USBSerial_print_n(buf,ISP_PACKET);
+  }
+  USBSerial_flush();
+}
 
 void loop() {
   int i;
@@ -249,7 +217,13 @@ void loop() {
 
   P14=(millis()&0x3FF)<50;
 
-  if (inProg && millis()-tLastProg>1000) {
+  if (icp_poll() && ackPending) completePending();
+
+#if INSTRUMENT
+  if (phase!=PH_IDLE) PHASE(PH_IDLE);
+#endif
+
+  if (inProg && icpState==ICP_IDLE && millis()-tLastProg>1000) {
     inProg=false;
     tLastProg=0;
 
@@ -265,36 +239,50 @@ void loop() {
 
   if (!USBSerial_available()) return;
 
+  PHASE(PH_USB_RECV);
   char cmd=USBSerial_read();
-  if (cmd!='R' && cmd!='W' && cmd!='X') return;
+#if INSTRUMENT
+  if (cmd=='T') { // timing counters: tick rate and ticks per phase, then reset
+    completePending();
+    sendPhases();
+    return;
+  }
+#endif
+  if (cmd!='R' && cmd!='S' && cmd!='W' && cmd!='P' && cmd!='E' && cmd!='X' && cmd!='I' && cmd!='B' && cmd!='U') return;
+
+  if (cmd=='B' || cmd=='U') {
+    completePending();
+    ispCommand(cmd,buf);
+    return;
+  }
   
   int mem=0;
   __xdata uint32_t addr=0;
-  if (cmd!='X') {
+  if (cmd!='X' && cmd!='I') {
     mem=readTimeout(1000);
     if (mem!='A' && mem!='L' && mem!='C') return;
-    if (mem!='C') {
-      int n=readTimeout(1000);
-      if (n<0) return;
-      addr=n;
-      n=readTimeout(1000);
-      if (n<0) return;
-      addr=addr*256+n;
-    }
+    if (mem!='C')
+      for (i=0;i<3;i++) { // 24 bit address, MSB first
+        int n=readTimeout(1000);
+        if (n<0) return;
+        addr=addr*256+n;
+      }
   }
 
-  if (cmd=='W') {
-    int len=mem=='C'?5:sizeof buf;
-
-    for (i=0;i<len;i++) {
-      int n=readTimeout(1000);    
+  __xdata uint32_t streamLen=0;
+  if (cmd=='S') {
+    if (mem=='C') return;
+    for (i=0;i<3;i++) { // 24 bit length, MSB first
+      int n=readTimeout(1000);
       if (n<0) return;
-      buf[i]=n;
+      streamLen=streamLen*256+n;
     }
   }
 
+  completePending();
+
   if (!inProg) {
-    clkDelay=SLOW;
+    PHASE(PH_ICP_SEND);
 
     pgm_dat_dir(1);
     pgm_set_dat(0);
@@ -303,16 +291,20 @@ void loop() {
     delay(12);
 
     icp_init();
-    clkDelay=FAST;
 
     usleep(120);
 
     //TODO: controllo dimensioni APROM e LDROM
 
-    uint16_t devid = icp_read_device_id();
-    uint8_t cid = icp_read_cid();
+    devId = icp_read_device_id();
+    cId = icp_read_cid();
+
+    dev=NULL;
+    for (i=0;i<sizeof devices/sizeof *devices;i++)
+      if (devices[i].devId==devId) dev=&devices[i];
 
-    if (/*cid!=NUVOTON_CID ||*/ devid!=N76E003_DEVID) {
+    if (/*cId!=NUVOTON_CID ||*/ dev==NULL) {
+      PHASE(PH_USB_SEND);
       USBSerial_write(0xFF);
       return;
     }
@@ -320,34 +312,88 @@ void loop() {
     __xdata uint8_t cfg1;
     icp_read_flash(CFG_FLASH_ADDR+1, 1, &cfg1);
 
-    ldRomSize=(7-(cfg1&7))*1024;
-    if (ldRomSize>4*1024) ldRomSize=4*1024;
+    setLdRomSize(cfg1);
 
     inProg=true;
   }
   tLastProg=millis();
 
+  if (cmd=='I') { // identify: device id, company id and 24 bit UID, LSB first
+    PHASE(PH_ICP_SEND);
+    __xdata uint32_t uid=icp_read_uid();
+    PHASE(PH_USB_SEND);
+    USBSerial_write(0);
+    USBSerial_write(devId);
+    USBSerial_write(devId>>8);
+    USBSerial_write(cId);
+    USBSerial_write(uid);
+    USBSerial_write(uid>>8);
+    USBSerial_write(uid>>16);
+    return;
+  }
+
+  if (cmd=='X') {
+    icp_mass_erase_start();
+    setLdRomSize(0xFF); // CONFIG is blank after it
+    ackPending=true; // sent by loop() once the erase is over
+    return;
+  }
+
   int len=0;
 
   switch(mem) {
     case 'C': len=CFG_FLASH_LEN; addr=CFG_FLASH_ADDR; break;
-    case 'L': addr+=18*1024-ldRomSize; //FALL THROUGH!
+    case 'L': addr+=dev->flashKB*1024UL-ldRomSize; //FALL THROUGH!
     case 'A': len=sizeof buf; break;
     default: USBSerial_write(100); return;
   }
 
   switch (cmd) {
-    case 'X':
-      icp_mass_erase();
-      USBSerial_write(0);
-      break;
     case 'R':
       icp_read_flash(addr, len, buf);
+      PHASE(PH_USB_SEND);
       USBSerial_write(0);
       USBSerial_print_n(buf,len);
       break;
+    case 'S':
+      // a single auto-incrementing ICP read across pages, handed to the USB
+      // IN endpoint a packet at a time: each packet goes out while the next
+      // one is being clocked in from the target
+      PHASE(PH_USB_SEND);
+      USBSerial_write(0);
+      PHASE(PH_ICP_SEND);
+      icp_send_command(CMD_READ_FLASH, addr);
+      while (streamLen) {
+        __data uint8_t n=streamLen>STREAM_CHUNK?STREAM_CHUNK:streamLen, j;
+        streamLen-=n;
+        PHASE(PH_ICP_RW);
+        for (j=0;j<n-1;j++)
+          buf[j]=icp_read_byte(0);
+        buf[j]=icp_read_byte(streamLen==0);
+        PHASE(PH_USB_SEND);
+        USBSerial_print_n(buf,n);
+        USBSerial_flush();
+      }
+      break;
+    case 'E':
+      icp_page_erase_start(addr);
+      ackPending=true; // sent by loop() once the erase is over
+      break;
+    case 'P': // program a blank page, i.e. 'W' without the erase
     case 'W':
-      icp_page_erase(addr);
+      // the page is erased while the rest of its new content is still being
+      // received, once the first byte has come; CONFIG is erased only when
+      // all of it is there, a command cut short must not leave the chip
+      // unlocked or booting from the other bank
+      PHASE(PH_USB_RECV);
+      for (i=0;i<len;i++) {
+        int n=readTimeout(1000);
+        if (n<0) return;
+        buf[i]=n;
+        if (cmd=='W' && mem!='C' && i==0) icp_page_erase_start(addr);
+      }
+      if (cmd=='W' && mem=='C') icp_page_erase_start(addr);
+      icp_wait();
       usleep(200);
 #if TRIGGER>0
       digitalWrite(TRIGGER,HIGH);
@@ -356,6 +402,8 @@ void loop() {
 #if TRIGGER>0
       digitalWrite(TRIGGER,LOW);
 #endif
+      if (mem=='C') setLdRomSize(buf[1]);
+      PHASE(PH_USB_SEND);
       USBSerial_write(0);
       break;
   }
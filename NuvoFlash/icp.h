@@ -0,0 +1,338 @@
+/* ICP layer of the programmer: the bit-banged protocol spoken to the target
+   on the DAT, CLK and RST lines. It is included by NuvoFlash.ino and, with
+   ICP_HOST defined and the pgm_* pin macros supplied by the includer, by the
+   host side emulator NuvoIcpEmu.c. The includer also provides PHASE(),
+   micros() and delayMicroseconds().
+*/
+#ifndef ICP_H
+#define ICP_H
+
+#define dat_line GPIO_DAT
+#define rst_line GPIO_RST
+#define clk_line GPIO_CLK
+
+#define GPIO_DAT	33//20
+#define GPIO_CLK	34//26
+#define GPIO_RST	35//21
+
+#define NUVOTON_CID 0xDA
+
+#define APROM_FLASH_ADDR	0x0
+#define CFG_FLASH_ADDR		0x30000UL
+#define CFG_FLASH_LEN		5
+
+#define CMD_READ_UID		0x04
+#define CMD_READ_CID		0x0b
+#define CMD_READ_DEVICE_ID	0x0c
+#define CMD_READ_FLASH		0x00
+#define CMD_WRITE_FLASH		0x21
+#define CMD_MASS_ERASE		0x26
+#define CMD_PAGE_ERASE		0x22
+
+// Supported parts: flash size (APROM + LDROM, LDROM at the top), LDROM size
+// unit (CONFIG1[2:0] encodes (7 - LDSIZE) units), largest LDROM, and
+// erase/program setup and hold times in us
+typedef struct {
+  uint16_t devId;
+  uint8_t flashKB, ldromUnitKB, ldromMaxKB;
+  uint32_t massEraseSetup;
+  uint16_t massEraseHold, pageEraseSetup, pageEraseHold;
+  uint8_t progSetup, progHold;
+} Device;
+
+__code const Device devices[] = {
+  {0x3650, 18, 1, 4, 100000, 10000, 10000, 1000, 200, 50}, // N76E003
+  {0x4B21, 16, 1, 4, 100000, 10000, 10000, 1000, 200, 50}, // MS51FB9AE
+};
+
+__code const Device *__xdata dev;
+
+// half period of CLK while entering ICP mode, in us
+#define ICP_SLOW_CLK 52
+
+#define usleep(x) delayMicroseconds(x)
+
+// least half period of CLK after the entry sequence, in us. Each bit costs
+// two of these waits plus the pin writes, so the default build takes at
+// least 4 us per bit, 32 us per byte, no less than the old per bit loop.
+// The minimum the target accepts has not been measured; ICP_CLK_HALF=0
+// drops the waits and is only for trying that out with a scope attached
+#ifndef ICP_CLK_HALF
+#define ICP_CLK_HALF 2
+#endif
+#if ICP_CLK_HALF > 0
+#define ICP_CLK_WAIT() usleep(ICP_CLK_HALF)
+#else
+#define ICP_CLK_WAIT()
+#endif
+
+#ifndef ICP_HOST
+__sbit __at(0xB0+3) P33;
+__sbit __at(0xB0+4) P34;
+__sbit __at(0xB0+5) P35;
+
+#define pgm_get_dat() (P33)
+#define pgm_set_rst(val) {P35=(val);}
+#define pgm_set_dat(val) {P33=(val);}
+#define pgm_set_clk(val) {P34=(val);}
+#define pgm_dat_dir(val) \
+  _Pragma("save")\
+  _Pragma("disable_warning 126")\
+  {if (val) {P3_MOD_OC|=0x08;P3_DIR_PU|=0x8;} else {P3_MOD_OC&=~0x8;P3_DIR_PU&=~0x8;}}\
+  _Pragma("restore")
+#endif
+#define pgm_deinit() pgm_set_rst(1)
+
+// Bits go out MSB first, the target samples DAT on the rising edge of CLK.
+// The macros unroll a byte into straight line code working on a byte in
+// internal RAM; the time per bit is set by ICP_CLK_WAIT(), not by the code.
+// DAT is an output all the time except inside icp_read_byte().
+#define ICP_OUT_BIT(b) {pgm_set_dat(((b) & 0x80)!=0); pgm_set_clk(1); (b)<<=1; ICP_CLK_WAIT(); pgm_set_clk(0); ICP_CLK_WAIT();}
+#define ICP_OUT_BYTE(b) \
+	ICP_OUT_BIT(b) ICP_OUT_BIT(b) ICP_OUT_BIT(b) ICP_OUT_BIT(b) \
+	ICP_OUT_BIT(b) ICP_OUT_BIT(b) ICP_OUT_BIT(b) ICP_OUT_BIT(b)
+#define ICP_IN_BIT(b) {(b)=(b)<<1 | pgm_get_dat(); pgm_set_clk(1); ICP_CLK_WAIT(); pgm_set_clk(0); ICP_CLK_WAIT();}
+#define ICP_IN_BYTE(b) \
+	ICP_IN_BIT(b) ICP_IN_BIT(b) ICP_IN_BIT(b) ICP_IN_BIT(b) \
+	ICP_IN_BIT(b) ICP_IN_BIT(b) ICP_IN_BIT(b) ICP_IN_BIT(b)
+
+void icp_send8(__data uint8_t data)
+{
+	ICP_OUT_BYTE(data);
+}
+
+void icp_send24(__data uint32_t data)
+{
+	icp_send8(data >> 16);
+	icp_send8(data >> 8);
+	icp_send8(data);
+}
+
+// the entry sequence, the only one clocked at ICP_SLOW_CLK
+void icp_send_slow(__xdata uint32_t data)
+{
+	__data uint8_t i = 24;
+
+	pgm_dat_dir(1);
+	while (i--) {
+		pgm_set_dat((data >> i) & 1);
+		pgm_set_clk(1);
+		usleep(ICP_SLOW_CLK);
+		pgm_set_clk(0);
+		usleep(ICP_SLOW_CLK);
+	}
+}
+
+void icp_send_command(__data uint8_t cmd, __xdata uint32_t dat)
+{
+	icp_send24((dat << 6) | cmd);
+}
+
+void icp_init(void)
+{
+	uint32_t icp_seq = 0xae1cb6;
+	int i = 24;
+
+	while (i--) {
+		pgm_set_rst((icp_seq >> i) & 1);
+		usleep(10000);
+	}
+
+	usleep(100);
+
+	icp_send_slow(0x5aa503);
+}
+
+void icp_exit(void)
+{
+	pgm_set_rst(1);
+	usleep(5000);
+	pgm_set_rst(0);
+	usleep(10000);
+	icp_send24(0xf78f0);
+	usleep(500);
+	pgm_set_rst(1);
+}
+
+uint8_t icp_read_byte(__data uint8_t end)
+{
+	__data uint8_t data = 0;
+
+	pgm_dat_dir(0);
+	ICP_IN_BYTE(data);
+	pgm_dat_dir(1);
+	pgm_set_dat(end);
+	pgm_set_clk(1);
+	ICP_CLK_WAIT();
+	pgm_set_clk(0);
+	ICP_CLK_WAIT();
+
+	return data;
+}
+
+void icp_write_byte(__data uint8_t data, __data uint8_t end, __data int delay1, __data int delay2)
+{
+	icp_send8(data);
+	pgm_set_dat(end);
+	usleep(delay1);
+	pgm_set_clk(1);
+	usleep(delay2);
+	pgm_set_dat(0);
+	pgm_set_clk(0);
+}
+
+uint16_t icp_read_device_id(void)
+{
+	icp_send_command(CMD_READ_DEVICE_ID, 0);
+
+	uint8_t devid[2];
+	devid[0] = icp_read_byte(0);
+	devid[1] = icp_read_byte(1);
+
+	return (devid[1] << 8) | devid[0];
+}
+
+uint8_t icp_read_cid(void)
+{
+	icp_send_command(CMD_READ_CID, 0);
+	return icp_read_byte(1);
+}
+
+uint32_t icp_read_uid(void)
+{
+	uint8_t uid[3];
+
+	for (int i = 0; i < sizeof(uid); i++) {
+		icp_send_command(CMD_READ_UID, i);
+		uid[i] = icp_read_byte(1);
+	}
+
+	return ((uint32_t)uid[2] << 16) | (uid[1] << 8) | uid[0];
+}
+
+uint32_t icp_read_ucid(void)
+{
+	uint8_t ucid[4];
+
+	for (int i = 0; i < sizeof(ucid); i++) {
+		icp_send_command(CMD_READ_UID, i + 0x20);
+		ucid[i] = icp_read_byte(1);
+	}
+
+	return ((uint32_t)ucid[3] << 24) | ((uint32_t)ucid[2] << 16) | (ucid[1] << 8) | ucid[0];
+}
+
+// the byte loops count in 16 bits with the last byte, which ends the
+// transfer, taken out of them
+uint32_t icp_read_flash(__xdata uint32_t addr, __xdata uint16_t len, __xdata uint8_t *__data data)
+{
+	__data uint16_t n = len - 1;
+
+	PHASE(PH_ICP_SEND);
+	icp_send_command(CMD_READ_FLASH, addr);
+	PHASE(PH_ICP_RW);
+
+	while (n--)
+		*data++ = icp_read_byte(0);
+	*data = icp_read_byte(1);
+
+	return addr + len;
+}
+
+uint32_t icp_write_flash(__xdata uint32_t addr, __xdata uint16_t len, __xdata uint8_t *__data data)
+{
+	__data uint16_t n = len - 1;
+	__data uint8_t setup = dev->progSetup, hold = dev->progHold;
+
+	PHASE(PH_ICP_SEND);
+	icp_send_command(CMD_WRITE_FLASH, addr);
+	PHASE(PH_ICP_RW);
+
+	while (n--)
+		icp_write_byte(*data++, 0, setup, hold);
+	icp_write_byte(*data, 1, setup, hold);
+
+	return addr + len;
+}
+
+// Erases are by far the longest ICP operations: instead of busy waiting they
+// are started and then completed by icp_poll(), which follows micros() (i.e.
+// Timer0) and is called from loop() and while waiting for host data. An
+// operation that needs the target calls icp_wait() first, so it starts the
+// instant the running erase is over.
+#define ICP_IDLE 0
+#define ICP_SETUP 1 // DAT set, waiting for the CLK rising edge
+#define ICP_HOLD 2  // CLK high, waiting to release DAT and CLK
+
+__data uint8_t icpState=ICP_IDLE;
+__data unsigned long icpT0, icpSetup, icpHold;
+
+// the asynchronous counterpart of icp_write_byte()
+void icp_write_byte_start(__data uint8_t data, __xdata int end, __xdata unsigned long delay1, __xdata unsigned long delay2)
+{
+	icp_send8(data);
+	pgm_set_dat(end);
+	icpSetup = delay1;
+	icpHold = delay2;
+	icpT0 = micros();
+	icpState = ICP_SETUP;
+}
+
+// advances the running operation, returns true once there is none
+bool icp_poll(void)
+{
+	switch (icpState) {
+	case ICP_SETUP:
+		if (micros() - icpT0 < icpSetup)
+			return false;
+		pgm_set_clk(1);
+		icpT0 = micros();
+		icpState = ICP_HOLD;
+		return false;
+	case ICP_HOLD:
+		if (micros() - icpT0 < icpHold)
+			return false;
+		pgm_set_dat(0);
+		pgm_set_clk(0);
+		icpState = ICP_IDLE;
+	}
+	return true;
+}
+
+void icp_wait(void)
+{
+	if (icpState == ICP_IDLE)
+		return;
+	PHASE(PH_ICP_ERASE);
+	while (!icp_poll());
+}
+
+void icp_mass_erase_start(void)
+{
+	icp_wait();
+	PHASE(PH_ICP_SEND);
+	icp_send_command(CMD_MASS_ERASE, 0x3A5A5);
+	icp_write_byte_start(0xff, 1, dev->massEraseSetup, dev->massEraseHold);
+}
+
+void icp_page_erase_start(__xdata uint32_t addr)
+{
+	icp_wait();
+	PHASE(PH_ICP_SEND);
+	icp_send_command(CMD_PAGE_ERASE, addr);
+	icp_write_byte_start(0xff, 1, dev->pageEraseSetup, dev->pageEraseHold);
+}
+
+void icp_mass_erase(void)
+{
+	icp_mass_erase_start();
+	icp_wait();
+}
+
+void icp_page_erase(__xdata uint32_t addr)
+{
+	icp_page_erase_start(addr);
+	icp_wait();
+}
+
+#endif
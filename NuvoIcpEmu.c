@@ -0,0 +1,403 @@
+//! gcc -Wall -I . "%file%" -o "%name%"
+// Runs the ICP layer of the firmware on the host against a model of the
+// N76E003 side of the protocol, counting clock edges, pin writes and
+// modelled time of each operation
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define MAX_OPS 16
+#define FLASH_SIZE (18 * 1024)
+#define PAGE_SIZE 128
+
+#define PIN_DAT 0
+#define PIN_CLK 1
+#define PIN_RST 2
+#define PIN_DIR 3 // DAT driven by the programmer
+
+void pinWrite(int pin, int val);
+int pinReadDat(void);
+unsigned long micros(void);
+void delayMicroseconds(unsigned long us);
+
+#define ICP_HOST
+#define __xdata
+#define __data
+#define __code
+#define PHASE(p)
+#define pgm_get_dat() pinReadDat()
+#define pgm_set_rst(val) pinWrite(PIN_RST, val)
+#define pgm_set_dat(val) pinWrite(PIN_DAT, val)
+#define pgm_set_clk(val) pinWrite(PIN_CLK, val)
+#define pgm_dat_dir(val) pinWrite(PIN_DIR, val)
+
+#include "NuvoFlash/icp.h"
+
+// state of the target, advanced on each rising edge of CLK
+typedef enum { OFF, ENTRY, COMMAND, READ, READ_END, WRITE, WRITE_END } State;
+
+struct {
+  State state;
+  uint32_t rstSeq, shift, addr;
+  int bits;
+  uint8_t cmd, byte;
+  uint8_t flash[FLASH_SIZE], config[CFG_FLASH_LEN], uid[3];
+} target;
+
+struct {
+  int pins[4];
+  uint64_t time, datTime, riseTime, setup;
+  bool ending; // CLK high on the last bit of a write
+  int end;
+} bus;
+
+typedef struct {
+  char name[16];
+  long edges, writes;
+  uint64_t time;
+} Op;
+
+Op ops[MAX_OPS], baseline[MAX_OPS];
+int nOps, nBaseline, errors;
+long edges, writes;
+
+void fail(const char *msg) {
+  fprintf(stderr, "Target: %s (state %d, command %02X, address %05X)\n", msg,
+          target.state, target.cmd, target.addr);
+  errors++;
+}
+
+unsigned long micros(void) {
+  return bus.time++; // each poll of the timer takes a microsecond
+}
+
+void delayMicroseconds(unsigned long us) { bus.time += us; }
+
+uint8_t targetRead(uint32_t addr) {
+  switch (target.cmd) {
+  case CMD_READ_DEVICE_ID:
+    return addr == 0 ? dev->devId : addr == 1 ? dev->devId >> 8 : 0xFF;
+  case CMD_READ_CID:
+    return NUVOTON_CID;
+  case CMD_READ_UID:
+    return addr < sizeof target.uid ? target.uid[addr] : 0xFF;
+  }
+  if (addr < dev->flashKB * 1024UL)
+    return target.flash[addr];
+  if (addr >= CFG_FLASH_ADDR && addr < CFG_FLASH_ADDR + CFG_FLASH_LEN)
+    return target.config[addr - CFG_FLASH_ADDR];
+  return 0xFF;
+}
+
+// the setup and hold times of the last bit of a write start the operation,
+// the target is not driven beyond what the data sheet allows
+void targetWrite(uint64_t setup, uint64_t hold) {
+  uint32_t a = target.addr;
+
+  switch (target.cmd) {
+  case CMD_WRITE_FLASH:
+    if (setup < dev->progSetup || hold < dev->progHold)
+      fail("program timing violated");
+    else if (a < dev->flashKB * 1024UL)
+      target.flash[a] &= target.byte;
+    else if (a >= CFG_FLASH_ADDR && a < CFG_FLASH_ADDR + CFG_FLASH_LEN)
+      target.config[a - CFG_FLASH_ADDR] &= target.byte;
+    target.addr++;
+    break;
+  case CMD_PAGE_ERASE:
+    if (setup < dev->pageEraseSetup || hold < dev->pageEraseHold)
+      fail("page erase timing violated");
+    else if (a < dev->flashKB * 1024UL)
+      memset(target.flash + (a & ~(PAGE_SIZE - 1)), 0xFF, PAGE_SIZE);
+    else if (a == CFG_FLASH_ADDR)
+      memset(target.config, 0xFF, sizeof target.config);
+    break;
+  case CMD_MASS_ERASE:
+    if (a != 0x3A5A5)
+      fail("bad mass erase key");
+    else if (setup < dev->massEraseSetup || hold < dev->massEraseHold)
+      fail("mass erase timing violated");
+    else {
+      memset(target.flash, 0xFF, sizeof target.flash);
+      memset(target.config, 0xFF, sizeof target.config);
+    }
+  }
+}
+
+void targetCommand(void) {
+  target.cmd = target.shift & 0x3F;
+  target.addr = target.shift >> 6;
+  target.bits = 0;
+  switch (target.cmd) {
+  case CMD_READ_DEVICE_ID:
+  case CMD_READ_CID:
+  case CMD_READ_UID:
+  case CMD_READ_FLASH:
+    target.byte = targetRead(target.addr);
+    target.state = READ;
+    break;
+  case CMD_WRITE_FLASH:
+  case CMD_PAGE_ERASE:
+  case CMD_MASS_ERASE:
+    target.state = WRITE;
+    break;
+  default:
+    fail("unknown command");
+    target.state = COMMAND;
+  }
+}
+
+void targetClock(void) {
+  int dat = bus.pins[PIN_DAT];
+
+  if (target.state == OFF)
+    return;
+  if (!bus.pins[PIN_DIR] && target.state != READ)
+    fail("DAT not driven");
+  else if (bus.pins[PIN_DIR] && target.state == READ)
+    fail("DAT driven while the target sends");
+  switch (target.state) {
+  case OFF:
+    break;
+  case ENTRY:
+  case COMMAND:
+    target.shift = (target.shift << 1 | dat) & 0xFFFFFF;
+    if (++target.bits < 24)
+      break;
+    target.bits = 0;
+    if (target.state == COMMAND)
+      targetCommand();
+    else if (target.shift == 0x5AA503)
+      target.state = COMMAND;
+    else {
+      fail("bad entry sequence");
+      target.state = OFF;
+    }
+    break;
+  case READ:
+    if (++target.bits == 8)
+      target.state = READ_END;
+    break;
+  case READ_END:
+    target.bits = 0;
+    if (dat)
+      target.state = COMMAND;
+    else {
+      target.byte = targetRead(++target.addr);
+      target.state = READ;
+    }
+    break;
+  case WRITE:
+    target.byte = target.byte << 1 | dat;
+    if (++target.bits == 8)
+      target.state = WRITE_END;
+    break;
+  case WRITE_END:
+    bus.ending = true;
+    bus.setup = bus.time - bus.datTime;
+    bus.end = dat;
+    break;
+  }
+}
+
+void pinWrite(int pin, int val) {
+  val = val != 0;
+  writes++;
+  if (bus.pins[pin] == val && pin != PIN_RST)
+    return;
+  bus.pins[pin] = val;
+  switch (pin) {
+  case PIN_DAT:
+    bus.datTime = bus.time;
+    break;
+  case PIN_CLK:
+    edges++;
+    if (val) {
+      bus.riseTime = bus.time;
+      targetClock();
+    } else if (bus.ending) {
+      // the hold time of the last bit of a write ends with CLK going low
+      bus.ending = false;
+      targetWrite(bus.setup, bus.time - bus.riseTime);
+      target.bits = 0;
+      target.state = bus.end ? COMMAND : WRITE;
+    }
+    break;
+  case PIN_RST:
+    // the entry sequence is a pattern on RST, 10 ms per bit
+    target.rstSeq = (target.rstSeq << 1 | val) & 0xFFFFFF;
+    if (target.rstSeq == 0xAE1CB6) {
+      target.state = ENTRY;
+      target.bits = 0;
+    } else if (val && target.state != ENTRY)
+      target.state = OFF;
+    break;
+  }
+}
+
+int pinReadDat(void) {
+  if (bus.pins[PIN_DIR])
+    return bus.pins[PIN_DAT];
+  if (target.state != READ)
+    return 1; // pulled up
+  return target.byte >> (7 - target.bits) & 1;
+}
+
+void begin(const char *name) {
+  if (nOps == MAX_OPS) {
+    fputs("Too many operations\n", stderr);
+    exit(1);
+  }
+  strncpy(ops[nOps].name, name, sizeof ops[nOps].name - 1);
+  ops[nOps].edges = edges;
+  ops[nOps].writes = writes;
+  ops[nOps].time = bus.time;
+}
+
+void end(void) {
+  ops[nOps].edges = edges - ops[nOps].edges;
+  ops[nOps].writes = writes - ops[nOps].writes;
+  ops[nOps].time = bus.time - ops[nOps].time;
+  nOps++;
+}
+
+void check(bool ok, const char *what) {
+  if (!ok) {
+    fprintf(stderr, "Check failed: %s\n", what);
+    errors++;
+  }
+}
+
+// the operations of the firmware, entered as loop() does
+void run(void) {
+  uint8_t page[PAGE_SIZE], buf[1024];
+  const uint32_t addr = 0x200;
+
+  for (int i = 0; i < PAGE_SIZE; i++)
+    page[i] = rand();
+  memset(target.flash, 0x5A, sizeof target.flash);
+  memset(target.config, 0xFF, sizeof target.config);
+  memcpy(target.uid, "\x56\x34\x12", 3);
+  dev = &devices[0];
+
+  begin("entry");
+  pgm_dat_dir(1);
+  pgm_set_dat(0);
+  pgm_set_clk(0);
+  pgm_set_rst(0);
+  usleep(12000);
+  icp_init();
+  usleep(120);
+  end();
+  check(target.state == COMMAND, "ICP mode entered");
+
+  begin("device_id");
+  check(icp_read_device_id() == dev->devId, "device id");
+  end();
+  begin("cid");
+  check(icp_read_cid() == NUVOTON_CID, "company id");
+  end();
+  begin("uid");
+  check(icp_read_uid() == 0x123456, "UID");
+  end();
+
+  begin("page_erase");
+  icp_page_erase(addr);
+  end();
+  check(target.flash[addr] == 0xFF && target.flash[addr + PAGE_SIZE - 1] == 0xFF,
+        "page erased");
+  begin("write_page");
+  icp_write_flash(addr, PAGE_SIZE, page);
+  end();
+  check(memcmp(target.flash + addr, page, PAGE_SIZE) == 0, "page written");
+  begin("read_page");
+  icp_read_flash(addr, PAGE_SIZE, buf);
+  end();
+  check(memcmp(buf, page, PAGE_SIZE) == 0, "page read back");
+  begin("read_1k");
+  icp_read_flash(0, sizeof buf, buf);
+  end();
+  check(memcmp(buf, target.flash, sizeof buf) == 0, "1 KB read back");
+
+  begin("mass_erase");
+  icp_mass_erase();
+  end();
+  check(target.flash[0] == 0xFF && target.flash[FLASH_SIZE - 1] == 0xFF,
+        "flash mass erased");
+
+  begin("exit");
+  icp_exit();
+  pgm_deinit();
+  end();
+  check(target.state == OFF, "ICP mode left");
+}
+
+void loadBaseline(const char *filename) {
+  char line[100];
+  FILE *f = fopen(filename, "r");
+
+  if (f == NULL) {
+    fprintf(stderr, "Cannot read from file %s\n", filename);
+    exit(1);
+  }
+  while (nBaseline < MAX_OPS && fgets(line, sizeof line, f) != NULL) {
+    Op *b = &baseline[nBaseline];
+    unsigned long long t;
+    if (sscanf(line, "%15s %ld %ld %llu", b->name, &b->edges, &b->writes,
+               &t) == 4) {
+      b->time = t;
+      nBaseline++;
+    }
+  }
+  fclose(f);
+}
+
+// prints the counters, and their change from the baseline if there is one,
+// returns the number of operations which got more expensive
+int report(void) {
+  int worse = 0;
+
+  printf("%-12s %8s %8s %12s\n", "op", "edges", "writes", "time us");
+  for (int i = 0; i < nOps; i++) {
+    Op *o = &ops[i], *b = NULL;
+    for (int j = 0; j < nBaseline; j++)
+      if (strcmp(baseline[j].name, o->name) == 0)
+        b = &baseline[j];
+    printf("%-12s %8ld %8ld %12llu", o->name, o->edges, o->writes,
+           (unsigned long long)o->time);
+    if (b != NULL) {
+      printf("  %+8ld %+8ld %+12lld", o->edges - b->edges,
+             o->writes - b->writes, (long long)o->time - (long long)b->time);
+      if (o->edges > b->edges || o->writes > b->writes || o->time > b->time)
+        worse++;
+    }
+    putchar('\n');
+  }
+  return worse;
+}
+
+int main(int argc, char *argv[]) {
+  if (argc == 3 && strcmp(argv[1], "-b") == 0)
+    loadBaseline(argv[2]);
+  else if (argc != 1) {
+    fputs("Usage: nuvoicpemu [-b <baseline>]\n", stderr);
+    fputs("  -b\tshow the change from the output of a previous run, fail if "
+          "any operation got more expensive\n",
+          stderr);
+    exit(1);
+  }
+  run();
+  int worse = report();
+  if (errors > 0) {
+    fprintf(stderr, "%d protocol errors\n", errors);
+    return 2;
+  }
+  if (worse > 0) {
+    fprintf(stderr, "%d operations are more expensive than the baseline\n",
+            worse);
+    return 3;
+  }
+  return 0;
+}
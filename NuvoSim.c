@@ -0,0 +1,456 @@
+//! gcc -Wall "%file%" -o "%name%"
+// Stand-in for the programmer on a pseudo terminal, with an N76E003 behind
+// it and faults injected at configurable rates, for soak testing the host.
+// The ISP bootloader, reached through the B and U commands, is modelled too.
+#define _DEFAULT_SOURCE
+#define _XOPEN_SOURCE 600
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <termios.h>
+#include <time.h>
+#include <unistd.h>
+
+#define FLASH_SIZE (18 * 1024)
+#define PAGE_SIZE 128
+#define LDROM_MAX (4 * 1024)
+#define DEVID 0x3650
+#define CID 0xDA
+#define UID 0x123456
+#define CONFIG0_LOCK 0x02 // 0 = locked
+#define CMD_TIMEOUT 1000 // ms without data after which a command is dropped
+
+// same figures as the N76E003 entry of the device table in nuvoflash, in us
+#define MASS_ERASE_TIME 110000
+#define PAGE_ERASE_TIME 11000
+#define PROGRAM_TIME 250
+#define READ_TIME 30
+#define UART_BYTE_TIME 87 // 10 bits at 115200 baud
+
+// Nuvoton ISP packets, as handled by the bootloader in LDROM. The model is
+// written from the same reading of the protocol as nuvoflash (see its ISP
+// section) and has not been compared with a real bootloader, so it checks
+// that the two agree rather than that either matches the target
+#define ISP_PACKET 64
+#define ISP_UPDATE_APROM 0xA0
+#define ISP_READ_CONFIG 0xA2
+#define ISP_SYNC_PACKNO 0xA4
+#define ISP_RUN_APROM 0xAB
+#define ISP_CONNECT 0xAE
+#define ISP_GET_DEVICEID 0xB1
+#define ISP_READ_CHECKSUM 0xC8
+#define ISP_CONTINUE 0x00
+
+uint8_t flash[FLASH_SIZE], config[5];
+int master;
+bool timing = true;
+// per byte (drop, corrupt) and per command (stall, not responding) rates
+double dropRate, corruptRate, stallRate, noTargetRate;
+int stallMs = 2000;
+long nDropped, nCorrupted, nStalled, nNoTarget, nCommands;
+volatile sig_atomic_t stop;
+// state of the bootloader, running from a B command until RUN_APROM
+bool noBootloader, ispRunning, ispConnected;
+uint32_t ispPackNo, ispAddress, ispEnd;
+uint16_t ispSum;
+// LDROM size the firmware reads from CONFIG on entering ICP mode and updates
+// on X and W C, -1 out of ICP mode: it is left after CMD_TIMEOUT ms without
+// commands and by B
+int icpLdrom = -1;
+
+void usage() {
+  fputs("Usage: nuvosim [options]\n", stderr);
+  fputs("  -d <rate>\tdrop received and sent bytes with probability <rate>\n",
+        stderr);
+  fputs("  -c <rate>\tflip a bit of sent bytes with probability <rate>\n",
+        stderr);
+  fputs("  -s <rate>\tstall a command with probability <rate>\n", stderr);
+  fputs("  -S <ms>\tlength of a stall (default 2000)\n", stderr);
+  fputs("  -n <rate>\treply to a command as if the target was not "
+        "responding with probability <rate>\n",
+        stderr);
+  fputs("  -r <seed>\tseed of the fault generator\n", stderr);
+  fputs("  -f\t\tdo not model flash timing\n", stderr);
+  fputs("  -L\t\tno ISP bootloader in LDROM\n", stderr);
+  fputs("The pseudo terminal to point nuvoflash -p at is printed on stdout\n",
+        stderr);
+  exit(1);
+}
+
+bool chance(double rate) { return rate > 0 && drand48() < rate; }
+
+void sleepUs(long us) {
+  struct timespec ts = {us / 1000000, us % 1000000 * 1000};
+  nanosleep(&ts, NULL);
+}
+
+void flashDelay(long us) {
+  if (timing)
+    sleepUs(us);
+}
+
+// -1 if nothing arrives in CMD_TIMEOUT ms, as readTimeout() in the firmware
+int readByte() {
+  uint8_t b;
+
+  for (;;) {
+    struct pollfd pfd = {master, POLLIN, 0};
+    if (poll(&pfd, 1, CMD_TIMEOUT) <= 0 || read(master, &b, 1) != 1)
+      return -1;
+    if (!chance(dropRate))
+      return b;
+    nDropped++;
+  }
+}
+
+void sendBytes(const uint8_t *buf, int len) {
+  uint8_t out[FLASH_SIZE + 1];
+  int n = 0;
+
+  for (int i = 0; i < len; i++) {
+    if (chance(dropRate)) {
+      nDropped++;
+      continue;
+    }
+    out[n] = buf[i];
+    if (chance(corruptRate)) {
+      out[n] ^= 1 << (lrand48() & 7);
+      nCorrupted++;
+    }
+    n++;
+  }
+  if (n > 0 && write(master, out, n) != n)
+    fputs("Cannot write to pseudo terminal\n", stderr);
+}
+
+void sendStatus(uint8_t status) { sendBytes(&status, 1); }
+
+int ldromSize() {
+  int size = (7 - (config[1] & 7)) * 1024;
+  return size > LDROM_MAX ? LDROM_MAX : size;
+}
+
+uint32_t get32(const uint8_t *p) {
+  return p[0] | p[1] << 8 | p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+void put32(uint8_t *p, uint32_t v) {
+  for (int i = 0; i < 4; i++)
+    p[i] = v >> 8 * i;
+}
+
+// programs the bytes of an APROM update that fit, adding what then reads
+// back to the checksum
+void ispProgram(const uint8_t *data, int len) {
+  for (int i = 0; i < len && ispAddress < ispEnd; i++, ispAddress++) {
+    flash[ispAddress] &= data[i];
+    ispSum += flash[ispAddress];
+    flashDelay(PROGRAM_TIME);
+  }
+}
+
+// Handles a packet as the bootloader would. Only a CONNECT is listened to
+// until one arrives and packets out of sequence are ignored. The reply
+// starts with the sum of the packet received and the next packet number.
+bool ispPacket(const uint8_t *pkt, uint8_t *reply) {
+  uint32_t packNo = get32(pkt + 4);
+  uint16_t sum = 0;
+  int apromSize = FLASH_SIZE - ldromSize();
+
+  // it boots only if CONFIG0.CBS selects LDROM
+  if (noBootloader || !ispRunning || config[0] & 0x80 || ldromSize() == 0)
+    return false;
+  if (pkt[0] == ISP_CONNECT)
+    ispConnected = true;
+  else if (!ispConnected || packNo != ispPackNo + 1)
+    return false;
+  ispPackNo = packNo + 1;
+  memset(reply, 0, ISP_PACKET);
+  switch (pkt[0]) {
+  case ISP_SYNC_PACKNO:
+    ispPackNo = get32(pkt + 8);
+    break;
+  case ISP_GET_DEVICEID:
+    put32(reply + 8, DEVID);
+    break;
+  case ISP_READ_CONFIG:
+    memcpy(reply + 8, config, sizeof config);
+    break;
+  case ISP_UPDATE_APROM:
+    ispAddress = get32(pkt + 8);
+    ispEnd = ispAddress + get32(pkt + 12);
+    if (ispEnd > apromSize)
+      ispEnd = apromSize;
+    ispSum = 0;
+    for (int a = ispAddress / PAGE_SIZE * PAGE_SIZE; a < ispEnd;
+         a += PAGE_SIZE) {
+      memset(flash + a, 0xFF, PAGE_SIZE);
+      flashDelay(PAGE_ERASE_TIME);
+    }
+    ispProgram(pkt + 16, ISP_PACKET - 16);
+    break;
+  case ISP_CONTINUE:
+    ispProgram(pkt + 8, ISP_PACKET - 8);
+    break;
+  case ISP_READ_CHECKSUM:
+    for (uint32_t a = get32(pkt + 8), end = a + get32(pkt + 12);
+         a < end && a < apromSize; a++)
+      sum += flash[a];
+    reply[8] = sum;
+    reply[9] = sum >> 8;
+    sum = 0;
+    break;
+  case ISP_RUN_APROM:
+    ispRunning = ispConnected = false;
+    return false;
+  }
+  for (int i = 0; i < ISP_PACKET; i++)
+    sum += pkt[i];
+  reply[0] = sum;
+  reply[1] = sum >> 8;
+  put32(reply + 4, ispPackNo);
+  // updates are verified with the checksum of what has been programmed
+  if (pkt[0] == ISP_UPDATE_APROM || pkt[0] == ISP_CONTINUE) {
+    reply[8] = ispSum;
+    reply[9] = ispSum >> 8;
+  }
+  return true;
+}
+
+// B resets the target into the bootloader, U bridges packets to it
+void ispCommand(int c) {
+  uint8_t pkt[ISP_PACKET], reply[ISP_PACKET + 1];
+  bool ok = true;
+
+  if (c == 'B') {
+    ispRunning = true;
+    ispConnected = false;
+    sendStatus(0);
+    return;
+  }
+  int n = readByte(), check = readByte(), timeout = readByte();
+  if (n < 0 || check < 0 || timeout < 0)
+    return;
+  if ((n ^ check) != 0xFF) {
+    struct pollfd pfd = {master, POLLIN, 0};
+    while (poll(&pfd, 1, 100) > 0 && read(master, pkt, sizeof pkt) > 0)
+      ;
+    return;
+  }
+  while (n--) {
+    for (int i = 0; i < ISP_PACKET; i++) {
+      int b = readByte();
+      if (b < 0)
+        return;
+      pkt[i] = b;
+    }
+    if (ok) {
+      ok = ispPacket(pkt, reply + 1);
+      if (ok)
+        flashDelay(2 * ISP_PACKET * UART_BYTE_TIME);
+      else
+        sleepUs(timeout * 10000L);
+    }
+    reply[0] = ok ? 0 : 255;
+    sendBytes(reply, ok ? sizeof reply : 1);
+  }
+}
+
+bool readAddress(int *address) {
+  *address = 0;
+  for (int i = 0; i < 3; i++) {
+    int n = readByte();
+    if (n < 0)
+      return false;
+    *address = *address * 256 + n;
+  }
+  return true;
+}
+
+// one command, dropped silently as the firmware does when its arguments or
+// data do not arrive in time
+void command() {
+  uint8_t buf[FLASH_SIZE + 1];
+  int mem = 0, address = 0, len = PAGE_SIZE, c = readByte();
+
+  if (c < 0)
+    icpLdrom = -1;
+  if (c <= 0 || strchr("TRSWPEXIBU", c) == NULL)
+    return;
+  nCommands++;
+  if (c == 'B' || c == 'U') {
+    if (c == 'B')
+      icpLdrom = -1;
+    ispCommand(c);
+    return;
+  }
+  if (c != 'X' && c != 'I' && c != 'T') {
+    mem = readByte();
+    if (mem != 'A' && mem != 'L' && mem != 'C')
+      return;
+    if (mem != 'C' && !readAddress(&address))
+      return;
+  }
+  if (c == 'S' && (mem == 'C' || !readAddress(&len)))
+    return;
+  if (chance(stallRate)) {
+    sleepUs(stallMs * 1000L);
+    nStalled++;
+  }
+  if (chance(noTargetRate)) {
+    sendStatus(0xFF);
+    nNoTarget++;
+    return;
+  }
+  if (c != 'T' && icpLdrom < 0)
+    icpLdrom = ldromSize();
+  if (mem == 'C') {
+    address = FLASH_SIZE;
+    len = sizeof config;
+  } else if (mem == 'L')
+    address += FLASH_SIZE - icpLdrom;
+  if (c != 'I' && c != 'X' && c != 'T' &&
+      (address < 0 || address + len > FLASH_SIZE + (mem == 'C' ? 5 : 0))) {
+    sendStatus(100);
+    return;
+  }
+  uint8_t *p = mem == 'C' ? config : flash + address;
+
+  switch (c) {
+  case 'I':
+    buf[0] = 0;
+    buf[1] = DEVID & 0xFF;
+    buf[2] = DEVID >> 8;
+    buf[3] = CID;
+    buf[4] = UID & 0xFF;
+    buf[5] = UID >> 8 & 0xFF;
+    buf[6] = UID >> 16;
+    sendBytes(buf, 7);
+    break;
+  case 'T': // no firmware counters here: tick rate of 1 MHz and no ticks
+    memset(buf, 0, 29);
+    buf[1] = 1000000 & 0xFF;
+    buf[2] = 1000000 >> 8 & 0xFF;
+    buf[3] = 1000000 >> 16;
+    sendBytes(buf, 29);
+    break;
+  case 'X':
+    memset(flash, 0xFF, sizeof flash);
+    memset(config, 0xFF, sizeof config);
+    icpLdrom = ldromSize();
+    flashDelay(MASS_ERASE_TIME);
+    sendStatus(0);
+    break;
+  case 'E':
+    memset(flash + address / PAGE_SIZE * PAGE_SIZE, 0xFF, PAGE_SIZE);
+    flashDelay(PAGE_ERASE_TIME);
+    sendStatus(0);
+    break;
+  case 'R':
+  case 'S':
+    buf[0] = 0;
+    memcpy(buf + 1, p, len);
+    // a locked chip reads as blank, CONFIG aside
+    if (mem != 'C' && !(config[0] & CONFIG0_LOCK))
+      memset(buf + 1, 0xFF, len);
+    flashDelay(len * READ_TIME);
+    sendBytes(buf, len + 1);
+    break;
+  case 'W':
+  case 'P':
+    // as in the firmware a page is erased as soon as its first byte has
+    // arrived, CONFIG only once all of it has
+    for (int i = 0; i < len; i++) {
+      int n = readByte();
+      if (n < 0)
+        return;
+      buf[i] = n;
+      if (c == 'W' && mem != 'C' && i == 0)
+        memset(p, 0xFF, len);
+    }
+    if (c == 'W') {
+      if (mem == 'C')
+        memset(p, 0xFF, len);
+      flashDelay(PAGE_ERASE_TIME);
+    }
+    for (int i = 0; i < len; i++)
+      p[i] &= buf[i];
+    if (mem == 'C')
+      icpLdrom = ldromSize();
+    flashDelay(len * PROGRAM_TIME);
+    sendStatus(0);
+  }
+}
+
+void onSignal(int sig) { stop = 1; }
+
+int main(int argc, char *argv[]) {
+  struct termios tio;
+  long seed = time(NULL);
+  int opt;
+
+  while ((opt = getopt(argc, argv, "d:c:s:S:n:r:fL")) != -1)
+    switch (opt) {
+    case 'd':
+      dropRate = atof(optarg);
+      break;
+    case 'c':
+      corruptRate = atof(optarg);
+      break;
+    case 's':
+      stallRate = atof(optarg);
+      break;
+    case 'S':
+      stallMs = atoi(optarg);
+      break;
+    case 'n':
+      noTargetRate = atof(optarg);
+      break;
+    case 'r':
+      seed = atol(optarg);
+      break;
+    case 'f':
+      timing = false;
+      break;
+    case 'L':
+      noBootloader = true;
+      break;
+    default:
+      usage();
+    }
+  if (optind != argc)
+    usage();
+  srand48(seed);
+  memset(flash, 0xFF, sizeof flash);
+  memset(config, 0xFF, sizeof config);
+
+  master = posix_openpt(O_RDWR | O_NOCTTY);
+  if (master < 0 || grantpt(master) != 0 || unlockpt(master) != 0) {
+    fputs("Cannot create pseudo terminal\n", stderr);
+    exit(1);
+  }
+  // keeping the slave open avoids EIO on the master when the host closes it
+  int slave = open(ptsname(master), O_RDWR | O_NOCTTY);
+  tcgetattr(slave, &tio);
+  cfmakeraw(&tio);
+  tcsetattr(slave, TCSANOW, &tio);
+  printf("%s\n", ptsname(master));
+  fflush(stdout);
+
+  signal(SIGINT, onSignal);
+  signal(SIGTERM, onSignal);
+  while (!stop)
+    command();
+  fprintf(stderr,
+          "%ld commands, %ld bytes dropped, %ld corrupted, %ld stalls, "
+          "%ld target not responding\n",
+          nCommands, nDropped, nCorrupted, nStalled, nNoTarget);
+  close(slave);
+  close(master);
+  return 0;
+}
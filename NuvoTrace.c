@@ -0,0 +1,271 @@
+//! gcc -Wall -I . "%file%" -o "%name%"
+// Offline analysis and replay of the transcripts captured by nuvoflash -c
+#define _DEFAULT_SOURCE
+#define _XOPEN_SOURCE 600
+#include <fcntl.h>
+#include <poll.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <termios.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+
+#include "trace.h"
+
+#define MAX_KEYS 32
+
+typedef struct {
+  TraceFrame h;
+  uint8_t *data;
+} Frame;
+
+// a transaction is a command sent by the host and all of the replies to it
+typedef struct {
+  char key[4];
+  int count, timeouts;
+  long bytes;
+  uint64_t host, wait, transfer;
+  uint64_t *total;
+} Stats;
+
+Frame *frames;
+int nFrames;
+Stats stats[MAX_KEYS];
+int nStats;
+
+void usage() {
+  fputs("Usage: nuvotrace stats <trace>\n", stderr);
+  fputs("       nuvotrace replay [-t] <trace>\n", stderr);
+  fputs("  stats\tlatency breakdown per command type\n", stderr);
+  fputs("  replay\tact as the programmer on a pseudo terminal, answering the "
+        "host as in the trace\n",
+        stderr);
+  fputs("  -t\treproduce the timing of the replies\n", stderr);
+  exit(1);
+}
+
+void load(const char *filename) {
+  char magic[4];
+  int size = 0;
+  FILE *f = fopen(filename, "rb");
+
+  if (f == NULL) {
+    fprintf(stderr, "Cannot read from file %s\n", filename);
+    exit(1);
+  }
+  if (fread(magic, 1, 4, f) != 4 || memcmp(magic, TRACE_MAGIC, 4) != 0 ||
+      fgetc(f) != TRACE_VERSION) {
+    fprintf(stderr, "%s is not a nuvoflash trace\n", filename);
+    exit(1);
+  }
+  for (;;) {
+    Frame fr;
+    if (fread(&fr.h, sizeof fr.h, 1, f) != 1)
+      break;
+    fr.data = malloc(fr.h.len ? fr.h.len : 1);
+    if (fread(fr.data, 1, fr.h.len, f) != fr.h.len) {
+      fputs("Trace is truncated\n", stderr);
+      free(fr.data);
+      break;
+    }
+    if (nFrames == size) {
+      size = size ? 2 * size : 1024;
+      frames = realloc(frames, size * sizeof *frames);
+    }
+    frames[nFrames++] = fr;
+  }
+  fclose(f);
+}
+
+Stats *statsFor(const Frame *cmd) {
+  char key[4] = {cmd->data[0]};
+
+  if (strchr("RSW", key[0]) != NULL && cmd->h.len > 1) {
+    key[1] = ' ';
+    key[2] = cmd->data[1];
+  }
+  for (int i = 0; i < nStats; i++)
+    if (strcmp(stats[i].key, key) == 0)
+      return &stats[i];
+  if (nStats == MAX_KEYS) {
+    fputs("Too many command types\n", stderr);
+    exit(1);
+  }
+  strcpy(stats[nStats].key, key);
+  stats[nStats].total = malloc(nFrames * sizeof(uint64_t));
+  return &stats[nStats++];
+}
+
+int cmpU64(const void *a, const void *b) {
+  uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+  return x < y ? -1 : x > y;
+}
+
+uint64_t percentile(const Stats *s, int p) {
+  return s->total[(s->count - 1) * p / 100];
+}
+
+void printStats() {
+  uint64_t first = 0, last = 0, busy = 0;
+
+  for (int i = 0; i < nFrames;) {
+    const Frame *cmd = &frames[i];
+    if (cmd->h.dir != TRACE_WRITE || cmd->h.len == 0) {
+      i++;
+      continue;
+    }
+    Stats *s = statsFor(cmd);
+    uint64_t host = 0, wait = 0, transfer = 0;
+    bool firstRead = true, timeout = false;
+    int j = i;
+    // writes following the command (e.g. page data) and all the reads up to
+    // the next command belong to the same transaction
+    for (; j < nFrames; j++) {
+      const Frame *fr = &frames[j];
+      if (fr->h.dir == TRACE_WRITE && j > i &&
+          frames[j - 1].h.dir == TRACE_READ)
+        break;
+      if (fr->h.dir == TRACE_WRITE)
+        host += fr->h.duration;
+      else if (firstRead) {
+        wait += fr->h.duration;
+        firstRead = false;
+      } else
+        transfer += fr->h.duration;
+      if (fr->h.dir == TRACE_READ && fr->h.len < fr->h.requested)
+        timeout = true;
+      s->bytes += fr->h.len;
+    }
+    const Frame *end = &frames[j - 1];
+    uint64_t total = end->h.start + end->h.duration - cmd->h.start;
+    s->total[s->count++] = total;
+    s->host += host;
+    s->wait += wait;
+    s->transfer += transfer;
+    s->timeouts += timeout;
+    if (first == 0 && last == 0)
+      first = cmd->h.start;
+    last = end->h.start + end->h.duration;
+    busy += total;
+    i = j;
+  }
+
+  printf("%-5s %6s %9s %9s %9s %9s %9s %9s %9s %9s %5s\n", "cmd", "count",
+         "bytes", "total ms", "mean us", "p50 us", "p95 us", "host us",
+         "wait us", "xfer us", "tmo");
+  for (int i = 0; i < nStats; i++) {
+    Stats *s = &stats[i];
+    qsort(s->total, s->count, sizeof *s->total, cmpU64);
+    uint64_t sum = 0;
+    for (int j = 0; j < s->count; j++)
+      sum += s->total[j];
+    printf("%-5s %6d %9ld %9.1f %9.1f %9.1f %9.1f %9.1f %9.1f %9.1f %5d\n",
+           s->key, s->count, s->bytes, sum / 1e6, sum / 1e3 / s->count,
+           percentile(s, 50) / 1e3, percentile(s, 95) / 1e3,
+           s->host / 1e3 / s->count, s->wait / 1e3 / s->count,
+           s->transfer / 1e3 / s->count, s->timeouts);
+  }
+  printf("%d frames, %.3f s elapsed, %.3f s in transactions, %.3f s idle\n",
+         nFrames, (last - first) / 1e9, busy / 1e9,
+         (last - first - busy) / 1e9);
+}
+
+bool readFully(int fd, uint8_t *buf, int len) {
+  for (int n = 0; n < len;) {
+    struct pollfd pfd = {fd, POLLIN, 0};
+    if (poll(&pfd, 1, 10000) <= 0)
+      return false;
+    int r = read(fd, buf + n, len - n);
+    if (r <= 0)
+      return false;
+    n += r;
+  }
+  return true;
+}
+
+void sleepNs(uint64_t ns) {
+  struct timespec ts = {ns / 1000000000, ns % 1000000000};
+  nanosleep(&ts, NULL);
+}
+
+// the master side of a pseudo terminal stands in for the programmer, the
+// host is pointed at the slave side with nuvoflash -p
+void replay(bool timing) {
+  uint8_t buf[65536];
+  int mismatches = 0, i;
+  uint64_t prevEnd = 0;
+  struct termios tio;
+
+  int master = posix_openpt(O_RDWR | O_NOCTTY);
+  if (master < 0 || grantpt(master) != 0 || unlockpt(master) != 0) {
+    fputs("Cannot create pseudo terminal\n", stderr);
+    exit(1);
+  }
+  // keeping the slave open avoids EIO on the master when the host closes it
+  int slave = open(ptsname(master), O_RDWR | O_NOCTTY);
+  tcgetattr(slave, &tio);
+  cfmakeraw(&tio);
+  tcsetattr(slave, TCSANOW, &tio);
+  printf("%s\n", ptsname(master));
+  fflush(stdout);
+
+  for (i = 0; i < nFrames; i++) {
+    const Frame *fr = &frames[i];
+    if (fr->h.dir == TRACE_WRITE) {
+      if (!readFully(master, buf, fr->h.len)) {
+        fprintf(stderr, "Host stopped sending at frame %d\n", i);
+        break;
+      }
+      if (memcmp(buf, fr->data, fr->h.len) != 0) {
+        fprintf(stderr, "Host diverged from trace at frame %d\n", i);
+        mismatches++;
+      }
+    } else {
+      uint64_t end = fr->h.start + fr->h.duration;
+      if (timing && end > prevEnd)
+        sleepNs(end - prevEnd);
+      if (write(master, fr->data, fr->h.len) != fr->h.len) {
+        fprintf(stderr, "Cannot write to pseudo terminal\n");
+        break;
+      }
+    }
+    prevEnd = fr->h.start + fr->h.duration;
+  }
+  fprintf(stderr, "Replayed %d of %d frames, %d mismatches\n", i, nFrames,
+          mismatches);
+  // closing the master drops whatever the host has not read yet
+  for (int n = 1, t = 0; n > 0 && t < 5000; t++) {
+    ioctl(slave, FIONREAD, &n);
+    sleepNs(1000000);
+  }
+  close(slave);
+  close(master);
+}
+
+int main(int argc, char *argv[]) {
+  bool timing = false;
+  int opt;
+
+  if (argc < 3)
+    usage();
+  optind = 2;
+  while ((opt = getopt(argc, argv, "t")) != -1)
+    if (opt == 't')
+      timing = true;
+    else
+      usage();
+  if (optind != argc - 1)
+    usage();
+  load(argv[optind]);
+  if (strcmp(argv[1], "stats") == 0)
+    printStats();
+  else if (strcmp(argv[1], "replay") == 0)
+    replay(timing);
+  else
+    usage();
+  return 0;
+}
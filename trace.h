@@ -0,0 +1,25 @@
+// Protocol transcript format shared by nuvoflash (--capture) and nuvotrace
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stdint.h>
+
+#define TRACE_MAGIC "NFTR"
+#define TRACE_VERSION 1
+
+#define TRACE_WRITE 0 // host to programmer
+#define TRACE_READ 1  // programmer to host
+
+// Every frame is a header followed by len data bytes, all fields are little
+// endian. start is relative to the beginning of the capture, a read frame
+// shorter than requested timed out
+typedef struct __attribute__((packed)) {
+  uint64_t start;    // ns
+  uint32_t duration; // ns
+  uint8_t dir;
+  uint8_t reserved;
+  uint16_t requested;
+  uint16_t len;
+} TraceFrame;
+
+#endif